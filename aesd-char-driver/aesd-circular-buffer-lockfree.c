@@ -0,0 +1,158 @@
+/**
+ * @file aesd-circular-buffer-lockfree.c
+ * @brief Single and multi producer lock free rings of aesd_buffer_entry
+ *
+ * The single producer ring publishes entries with a release store of in_offs and frees slots
+ * with a release store of out_offs. The multi producer ring is a bounded queue with a sequence
+ * number per slot: producers claim an index with a compare and swap on in_offs and publish the
+ * slot by advancing its sequence, so the consumer never waits for an unrelated producer's index.
+ */
+
+#include <string.h>
+
+#include "aesd-circular-buffer-lockfree.h"
+
+/**
+ * Initializes @param ring to an empty ring over @param entries, an array of @param slots entries
+ * owned by the caller.
+ * @return 0 on success, -1 if slots is not a power of two
+ */
+int aesd_spsc_ring_init(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entries, uint32_t slots)
+{
+    if (slots == 0 || slots > AESDCHAR_MAX_CAPACITY || (slots & (slots - 1)) != 0)
+    {
+        return -1;
+    }
+    memset(entries, 0, sizeof(struct aesd_buffer_entry) * slots);
+    ring->entry = entries;
+    ring->mask = slots - 1;
+    atomic_init(&ring->in_offs, 0);
+    atomic_init(&ring->out_offs, 0);
+    ring->out_cached = 0;
+    ring->in_cached = 0;
+    return 0;
+}
+
+/**
+ * Appends a copy of @param entry, must only be called from the producer thread
+ * @return false if the ring is full
+ */
+bool aesd_spsc_ring_push(struct aesd_spsc_ring *ring, const struct aesd_buffer_entry *entry)
+{
+    uint32_t in_offs = atomic_load_explicit(&ring->in_offs, memory_order_relaxed);
+    if (in_offs - ring->out_cached > ring->mask)
+    {
+        ring->out_cached = atomic_load_explicit(&ring->out_offs, memory_order_acquire);
+        if (in_offs - ring->out_cached > ring->mask)
+        {
+            return false;
+        }
+    }
+    ring->entry[in_offs & ring->mask] = *entry;
+    atomic_store_explicit(&ring->in_offs, in_offs + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Removes the oldest entry into @param entry, must only be called from the consumer thread
+ * @return false if the ring is empty
+ */
+bool aesd_spsc_ring_pop(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entry)
+{
+    uint32_t out_offs = atomic_load_explicit(&ring->out_offs, memory_order_relaxed);
+    if (out_offs == ring->in_cached)
+    {
+        ring->in_cached = atomic_load_explicit(&ring->in_offs, memory_order_acquire);
+        if (out_offs == ring->in_cached)
+        {
+            return false;
+        }
+    }
+    *entry = ring->entry[out_offs & ring->mask];
+    atomic_store_explicit(&ring->out_offs, out_offs + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Initializes @param ring to an empty ring over @param slots, an array of @param count slots
+ * owned by the caller.
+ * @return 0 on success, -1 if count is not a power of two
+ */
+int aesd_mpsc_ring_init(struct aesd_mpsc_ring *ring, struct aesd_mpsc_slot *slots, uint32_t count)
+{
+    uint32_t index;
+    if (count == 0 || count > AESDCHAR_MAX_CAPACITY || (count & (count - 1)) != 0)
+    {
+        return -1;
+    }
+    for (index = 0; index < count; index++)
+    {
+        atomic_init(&slots[index].sequence, index);
+        slots[index].entry.buffptr = NULL;
+        slots[index].entry.size = 0;
+        slots[index].entry.stream_offs = 0;
+    }
+    ring->slot = slots;
+    ring->mask = count - 1;
+    atomic_init(&ring->in_offs, 0);
+    ring->out_offs = 0;
+    return 0;
+}
+
+/**
+ * Appends a copy of @param entry, may be called from any number of threads
+ * @return false if the ring is full
+ */
+bool aesd_mpsc_ring_push(struct aesd_mpsc_ring *ring, const struct aesd_buffer_entry *entry)
+{
+    uint32_t in_offs = atomic_load_explicit(&ring->in_offs, memory_order_relaxed);
+    struct aesd_mpsc_slot *slot;
+    for (;;)
+    {
+        slot = &ring->slot[in_offs & ring->mask];
+        uint32_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int32_t lag = (int32_t)(sequence - in_offs);
+        if (lag == 0)
+        {
+            // the slot is free for index in_offs, claim the index, a failed claim reloads in_offs
+            if (atomic_compare_exchange_weak_explicit(&ring->in_offs, &in_offs, in_offs + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (lag < 0)
+        {
+            // the slot still holds the entry pushed one round earlier
+            return false;
+        }
+        else
+        {
+            // another producer claimed in_offs already
+            in_offs = atomic_load_explicit(&ring->in_offs, memory_order_relaxed);
+        }
+    }
+    slot->entry = *entry;
+    atomic_store_explicit(&slot->sequence, in_offs + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Removes the oldest entry into @param entry, must only be called from the consumer thread.
+ * An entry whose producer claimed its index but hasn't finished publishing counts as not there yet.
+ * @return false if the ring is empty
+ */
+bool aesd_mpsc_ring_pop(struct aesd_mpsc_ring *ring, struct aesd_buffer_entry *entry)
+{
+    struct aesd_mpsc_slot *slot = &ring->slot[ring->out_offs & ring->mask];
+    uint32_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (sequence != ring->out_offs + 1)
+    {
+        return false;
+    }
+    *entry = slot->entry;
+    // hand the slot to the producer of the next round
+    atomic_store_explicit(&slot->sequence, ring->out_offs + ring->mask + 1, memory_order_release);
+    ring->out_offs++;
+    return true;
+}
@@ -0,0 +1,94 @@
+/*
+ * aesd-circular-buffer-lockfree.h
+ *
+ *  @brief Lock free rings of struct aesd_buffer_entry for userspace pipelines
+ *
+ *  Same entries as struct aesd_circular_buffer, the memory referenced by buffptr stays owned by
+ *  whoever produced it until the consumer takes the entry. Unlike aesd_circular_buffer_add_entry()
+ *  a full ring never overwrites the oldest entry, since the consumer may be using it: push fails
+ *  and the producer decides whether to retry or drop.
+ *
+ *  aesd_spsc_ring allows one producer and one consumer thread, aesd_mpsc_ring any number of
+ *  producer threads and one consumer thread. Both use C11 atomics and are not available in the
+ *  kernel build.
+ */
+
+#ifndef AESD_CIRCULAR_BUFFER_LOCKFREE_H
+#define AESD_CIRCULAR_BUFFER_LOCKFREE_H
+
+#ifdef __KERNEL__
+#error "the lock free rings are userspace only"
+#endif
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "aesd-circular-buffer.h"
+
+/**
+ * Keeps indices written by different threads on different cache lines
+ */
+#define AESD_RING_CACHE_LINE 64
+
+struct aesd_spsc_ring
+{
+    /**
+     * An array of mask + 1 entries provided to aesd_spsc_ring_init()
+     */
+    struct aesd_buffer_entry *entry;
+    uint32_t mask;
+    /**
+     * Free running index of the next entry to push, written by the producer only. out_cached is
+     * the producer's last view of out_offs, so it only touches the consumer's line when it looks full
+     */
+    _Alignas(AESD_RING_CACHE_LINE) _Atomic uint32_t in_offs;
+    uint32_t out_cached;
+    /**
+     * Free running index of the next entry to pop, written by the consumer only, with its last
+     * view of in_offs
+     */
+    _Alignas(AESD_RING_CACHE_LINE) _Atomic uint32_t out_offs;
+    uint32_t in_cached;
+};
+
+struct aesd_mpsc_slot
+{
+    /**
+     * Free running index the slot is ready to be pushed at, or that index + 1 once the entry is
+     * published and ready to be popped
+     */
+    _Atomic uint32_t sequence;
+    struct aesd_buffer_entry entry;
+};
+
+struct aesd_mpsc_ring
+{
+    /**
+     * An array of mask + 1 slots provided to aesd_mpsc_ring_init()
+     */
+    struct aesd_mpsc_slot *slot;
+    uint32_t mask;
+    /**
+     * Free running index the next producer claims
+     */
+    _Alignas(AESD_RING_CACHE_LINE) _Atomic uint32_t in_offs;
+    /**
+     * Free running index of the next entry to pop, only used by the consumer
+     */
+    _Alignas(AESD_RING_CACHE_LINE) uint32_t out_offs;
+};
+
+extern int aesd_spsc_ring_init(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entries, uint32_t slots);
+
+extern bool aesd_spsc_ring_push(struct aesd_spsc_ring *ring, const struct aesd_buffer_entry *entry);
+
+extern bool aesd_spsc_ring_pop(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entry);
+
+extern int aesd_mpsc_ring_init(struct aesd_mpsc_ring *ring, struct aesd_mpsc_slot *slots, uint32_t count);
+
+extern bool aesd_mpsc_ring_push(struct aesd_mpsc_ring *ring, const struct aesd_buffer_entry *entry);
+
+extern bool aesd_mpsc_ring_pop(struct aesd_mpsc_ring *ring, struct aesd_buffer_entry *entry);
+
+#endif /* AESD_CIRCULAR_BUFFER_LOCKFREE_H */
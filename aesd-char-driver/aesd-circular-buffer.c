@@ -10,8 +10,10 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/ktime.h>
 #else
 #include <string.h>
+#include <time.h>
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -29,93 +31,261 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
                                                                           size_t char_offset, size_t *entry_offset_byte_rtn)
 {
-    int i;
-    struct aesd_buffer_entry *entry;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, i)
+    uint32_t index;
+    if (aesd_circular_buffer_find_index_for_fpos(buffer, char_offset, &index, entry_offset_byte_rtn) != 0)
     {
-        if (i >= buffer->in_offs)
+        return NULL;
+    }
+    return aesd_circular_buffer_slot(buffer, index);
+}
+
+/**
+ * Like aesd_circular_buffer_find_entry_offset_for_fpos(), but reports the free running index of the
+ * entry in @param index_rtn, so callers can continue with the entries following it.
+ * @return 0 on success, -1 if char_offset is not available in the buffer
+ */
+int aesd_circular_buffer_find_index_for_fpos(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                             uint32_t *index_rtn, size_t *entry_offset_byte_rtn)
+{
+    // binary search for the last entry starting at or before char_offset, such an entry can't be
+    // empty unless char_offset is past the end, which is handled up front
+    uint32_t low = 0;
+    uint32_t high = aesd_circular_buffer_count(buffer);
+    if (char_offset >= buffer->total_size)
+    {
+        return -1;
+    }
+    while (high - low > 1)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (aesd_circular_buffer_entry_fpos(buffer, buffer->out_offs + middle) <= char_offset)
         {
-            if (char_offset < entry->size)
-            {
-                *entry_offset_byte_rtn = char_offset;
-                return entry;
-            }
-            else
-            {
-                char_offset -= entry->size;
-            }
+            low = middle;
+        }
+        else
+        {
+            high = middle;
         }
     }
+    *index_rtn = buffer->out_offs + low;
+    *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_entry_fpos(buffer, *index_rtn);
+    return 0;
+}
 
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, i)
+/**
+ * Finds the oldest entry of @param buffer added at or after @param timestamp_ns, with a binary
+ * search over the entry timestamps, which never decrease.
+ * @param index_rtn receives the free running index of the entry
+ * @return 0 on success, -1 if every entry is older or the buffer is empty
+ */
+int aesd_circular_buffer_find_index_for_time(struct aesd_circular_buffer *buffer, uint64_t timestamp_ns,
+                                             uint32_t *index_rtn)
+{
+    // binary search for the first entry not older than timestamp_ns, count means none
+    uint32_t low = 0;
+    uint32_t high = aesd_circular_buffer_count(buffer);
+    while (low < high)
     {
-        if (i < buffer->in_offs)
+        uint32_t middle = low + (high - low) / 2;
+        if (aesd_circular_buffer_slot(buffer, buffer->out_offs + middle)->timestamp_ns < timestamp_ns)
+        {
+            low = middle + 1;
+        }
+        else
         {
-            if (char_offset < entry->size)
-            {
-                *entry_offset_byte_rtn = char_offset;
-                return entry;
-            }
-            else
-            {
-                char_offset -= entry->size;
-            }
+            high = middle;
         }
     }
-    return NULL;
+    if (low == aesd_circular_buffer_count(buffer))
+    {
+        return -1;
+    }
+    *index_rtn = buffer->out_offs + low;
+    return 0;
+}
+
+/**
+ * Finds the entry of @param buffer with sequence @param sequence, or the oldest entry when that one
+ * was already evicted.
+ * @param index_rtn receives the free running index of the entry
+ * @return 0 on success, -1 if sequence wasn't added yet or the buffer is empty
+ */
+int aesd_circular_buffer_find_index_for_sequence(struct aesd_circular_buffer *buffer, uint64_t sequence,
+                                                 uint32_t *index_rtn)
+{
+    // sequences of stored entries are consecutive, ending just before buffer->sequence
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint64_t oldest = buffer->sequence - count;
+    if (count == 0 || sequence >= buffer->sequence)
+    {
+        return -1;
+    }
+    *index_rtn = buffer->out_offs + (sequence > oldest ? (uint32_t)(sequence - oldest) : 0);
+    return 0;
+}
+
+// monotonic clock reading stored with every entry
+static uint64_t aesd_circular_buffer_now_ns(void)
+{
+#ifdef __KERNEL__
+    return ktime_get_ns();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+// remove the oldest entry from a non empty buffer and return its buffptr
+static const char *evict_oldest(struct aesd_circular_buffer *buffer)
+{
+    // clear the slot so AESD_CIRCULAR_BUFFER_FOREACH never sees the evicted pointer again
+    struct aesd_buffer_entry *slot = aesd_circular_buffer_slot(buffer, buffer->out_offs);
+    const char *old_buffptr = slot->buffptr;
+    buffer->total_size -= slot->size;
+    slot->buffptr = NULL;
+    slot->size = 0;
+    buffer->out_offs++;
+    buffer->full = false;
+    return old_buffptr;
 }
 
 /**
  * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
  * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
- * new start location.
+ * new start location. The byte budget is not checked here, see aesd_circular_buffer_evict_for().
+ * With an arena, buffptr of @param add_entry is ignored: the entry describes the size bytes
+ * already written to the arena from buffer->stream_offs on. The stored entry gets its stream_offs,
+ * timestamp_ns and sequence from the buffer, whatever add_entry holds there.
  * Any necessary locking must be handled by the caller
  * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+ * @return the buffptr of the entry evicted to make room, which the caller must free, or NULL
  */
 const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
     // if buffer is full, overwrite oldest entry
     // return pointer to overwritten entry
     const char *old_buffprt = NULL;
-    if (buffer->entry[buffer->in_offs].buffptr != NULL)
+    struct aesd_buffer_entry *slot;
+    if (buffer->full)
     {
-        old_buffprt = buffer->entry[buffer->in_offs].buffptr;
-        buffer->total_size -= buffer->entry[buffer->in_offs].size;
+        old_buffprt = evict_oldest(buffer);
     }
 
-    buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
-    buffer->entry[buffer->in_offs].size = add_entry->size;
+    slot = aesd_circular_buffer_slot(buffer, buffer->in_offs);
+    slot->buffptr = buffer->arena == NULL ? add_entry->buffptr : NULL;
+    slot->size = add_entry->size;
+    slot->stream_offs = buffer->stream_offs;
+    slot->timestamp_ns = aesd_circular_buffer_now_ns();
+    slot->sequence = buffer->sequence++;
     buffer->in_offs++;
     buffer->total_size += add_entry->size;
+    buffer->stream_offs += add_entry->size;
 
-    if (buffer->in_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-    {
-        buffer->in_offs = 0;
-    }
+    buffer->full = aesd_circular_buffer_count(buffer) == buffer->capacity;
+    return old_buffprt;
+}
 
-    if (buffer->full == true)
+/**
+ * Evicts the oldest entry of @param buffer if adding an entry of @param size bytes would exceed
+ * either the capacity, buffer->byte_budget or the arena size. Call it until it returns false before
+ * aesd_circular_buffer_add_entry() to keep total_size within the budget; an entry larger than the
+ * whole budget evicts everything and is then stored on its own.
+ * With an arena, call it before writing the entry to the arena, so the write doesn't overwrite
+ * bytes still in use.
+ * Any necessary locking must be handled by the caller
+ * @param evicted receives the buffptr of the evicted entry, which the caller must free
+ * @return true if an entry was evicted, false once the new entry fits
+ */
+bool aesd_circular_buffer_evict_for(struct aesd_circular_buffer *buffer, size_t size, const char **evicted)
+{
+    size_t limit = buffer->byte_budget;
+    bool over_budget;
+    if (buffer->arena != NULL && (limit == 0 || limit > buffer->arena_mask))
     {
-        buffer->out_offs++;
-        if (buffer->out_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-        {
-            buffer->out_offs = 0;
-        }
+        limit = buffer->arena_mask + 1;
     }
-    else if (buffer->in_offs == buffer->out_offs)
+    over_budget = limit != 0 && (buffer->total_size > limit || size > limit - buffer->total_size);
+    if (aesd_circular_buffer_count(buffer) == 0 || (!buffer->full && !over_budget))
     {
-        buffer->full = true;
+        return false;
     }
-    return old_buffprt;
+    *evicted = evict_oldest(buffer);
+    return true;
 }
 
 /**
- * Initializes the circular buffer described by @param buffer to an empty struct
+ * Initializes the circular buffer described by @param buffer to an empty struct holding up to
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in its built in storage
  */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+    aesd_circular_buffer_init_capacity(buffer, buffer->default_entry, AESDCHAR_DEFAULT_SLOTS,
+                                       AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+ * Initializes the circular buffer described by @param buffer to an empty struct holding up to
+ * @param capacity entries in @param entries, an array of @param slots entries owned by the caller.
+ * @param slots must be a power of two, see aesd_circular_buffer_slots_for()
+ * @return 0 on success, -1 if slots is not a power of two or can't hold capacity entries
+ */
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+                                       uint32_t slots, uint32_t capacity)
+{
+    if (capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY || slots < capacity || (slots & (slots - 1)) != 0)
+    {
+        return -1;
+    }
+    memset(entries, 0, sizeof(struct aesd_buffer_entry) * slots);
+    buffer->entry = entries;
+    buffer->capacity = capacity;
+    buffer->mask = slots - 1;
     buffer->full = false;
     buffer->in_offs = 0;
     buffer->out_offs = 0;
     buffer->total_size = 0;
+    buffer->stream_offs = 0;
+    buffer->sequence = 0;
+    buffer->byte_budget = 0;
+    buffer->arena = NULL;
+    buffer->arena_mask = 0;
+    return 0;
+}
+
+/**
+ * @return the number of slots to allocate for @param capacity entries: the next power of two,
+ * or 0 when capacity exceeds AESDCHAR_MAX_CAPACITY
+ */
+uint32_t aesd_circular_buffer_slots_for(uint32_t capacity)
+{
+    uint32_t slots = 1;
+    if (capacity > AESDCHAR_MAX_CAPACITY)
+    {
+        return 0;
+    }
+    while (slots < capacity)
+    {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+/**
+ * Makes the empty @param buffer store entry contents in @param arena, a ring of @param arena_size
+ * bytes owned by the caller, instead of referencing caller allocated buffers. Entries can then be
+ * at most arena_size bytes, and eviction never hands back anything to free.
+ * @param arena_size must be a power of two
+ * @return 0 on success, -1 if the buffer isn't empty or arena_size is not a power of two
+ */
+int aesd_circular_buffer_set_arena(struct aesd_circular_buffer *buffer, char *arena, size_t arena_size)
+{
+    if (aesd_circular_buffer_count(buffer) != 0 || arena_size == 0 || (arena_size & (arena_size - 1)) != 0)
+    {
+        return -1;
+    }
+    buffer->arena = arena;
+    buffer->arena_mask = arena_size - 1;
+    return 0;
 }
@@ -16,60 +16,169 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default capacity, used by aesd_circular_buffer_init()
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Slots backing the default capacity, the slot count is always a power of two so indices wrap
+ * with a mask
+ */
+#define AESDCHAR_DEFAULT_SLOTS 16
+/**
+ * Largest capacity aesd_circular_buffer_init_capacity() accepts
+ */
+#define AESDCHAR_MAX_CAPACITY (1U << 31)
 
 struct aesd_buffer_entry
 {
     /**
-     * A location where the buffer contents in buffptr are stored
+     * A location where the buffer contents in buffptr are stored, NULL when the buffer stores
+     * contents in its arena
      */
     const char *buffptr;
     /**
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Position of the first byte of this entry in the stream of every byte ever added to the
+     * buffer, set by aesd_circular_buffer_add_entry(). Differences between entries are their
+     * cumulative sizes, which makes fpos lookups a binary search.
+     */
+    size_t stream_offs;
+    /**
+     * Monotonic clock in nanoseconds when aesd_circular_buffer_add_entry() stored the entry,
+     * ktime_get_ns() in the kernel and CLOCK_MONOTONIC in user space, which are the same clock.
+     * Never decreases from one entry to the next, so time lookups are a binary search too.
+     */
+    uint64_t timestamp_ns;
+    /**
+     * Number of entries added to the buffer before this one, set by aesd_circular_buffer_add_entry()
+     */
+    uint64_t sequence;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of mask + 1 entries for the most recent write operations, either default_entry or
+     * an array provided to aesd_circular_buffer_init_capacity()
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
     /**
-     * The current location in the entry structure where the next write should
-     * be stored.
+     * Storage used by aesd_circular_buffer_init()
      */
-    uint8_t in_offs;
+    struct aesd_buffer_entry default_entry[AESDCHAR_DEFAULT_SLOTS];
     /**
-     * The first location in the entry structure to read from
+     * Maximum number of entries kept before the oldest is overwritten, at most mask + 1
      */
-    uint8_t out_offs;
+    uint32_t capacity;
     /**
-     * set to true when the buffer entry structure is full
+     * Number of slots in entry minus one, the slot of index i is entry[i & mask]
+     */
+    uint32_t mask;
+    /**
+     * Free running index of the location where the next write should be stored
+     */
+    uint32_t in_offs;
+    /**
+     * Free running index of the first location to read from
+     */
+    uint32_t out_offs;
+    /**
+     * set to true when the buffer holds capacity entries
      */
     bool full;
     /**
      * total size of characters stored in the buffer
      */
     size_t total_size;
+    /**
+     * stream_offs the next added entry gets
+     */
+    size_t stream_offs;
+    /**
+     * sequence the next added entry gets
+     */
+    uint64_t sequence;
+    /**
+     * Upper limit for total_size enforced by aesd_circular_buffer_evict_for(), 0 for none.
+     * Set after initialization, the init functions clear it.
+     */
+    size_t byte_budget;
+    /**
+     * Optional ring of arena_mask + 1 bytes set up by aesd_circular_buffer_set_arena(). The byte
+     * at stream offset s lives at arena[s & arena_mask], so entries only describe their position.
+     */
+    char *arena;
+    size_t arena_mask;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern int aesd_circular_buffer_find_index_for_fpos(struct aesd_circular_buffer *buffer, size_t char_offset,
+            uint32_t *index_rtn, size_t *entry_offset_byte_rtn);
+
+extern int aesd_circular_buffer_find_index_for_time(struct aesd_circular_buffer *buffer, uint64_t timestamp_ns,
+            uint32_t *index_rtn);
+
+extern int aesd_circular_buffer_find_index_for_sequence(struct aesd_circular_buffer *buffer, uint64_t sequence,
+            uint32_t *index_rtn);
+
 extern const char * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern bool aesd_circular_buffer_evict_for(struct aesd_circular_buffer *buffer, size_t size, const char **evicted);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+            uint32_t slots, uint32_t capacity);
+
+extern uint32_t aesd_circular_buffer_slots_for(uint32_t capacity);
+
+extern int aesd_circular_buffer_set_arena(struct aesd_circular_buffer *buffer, char *arena, size_t arena_size);
+
+/**
+ * Number of entries currently stored in the buffer
+ */
+#define aesd_circular_buffer_count(buffer) ((uint32_t)((buffer)->in_offs - (buffer)->out_offs))
+
+/**
+ * The entry stored at free running index, e.g. (buffer)->out_offs for the oldest entry
+ */
+#define aesd_circular_buffer_slot(buffer, index) (&(buffer)->entry[(index) & (buffer)->mask])
+
+/**
+ * Character offset of the first byte of the entry stored at free running index, counted from the
+ * start of the oldest entry. Only valid for indices between out_offs and in_offs.
+ */
+#define aesd_circular_buffer_entry_fpos(buffer, index) \
+    (aesd_circular_buffer_slot(buffer, index)->stream_offs - \
+     aesd_circular_buffer_slot(buffer, (buffer)->out_offs)->stream_offs)
+
+/**
+ * Stream offset of the first byte still stored in the buffer
+ */
+#define aesd_circular_buffer_first_stream_offs(buffer) ((buffer)->stream_offs - (buffer)->total_size)
+
+/**
+ * Location of the byte at stream_offs in the arena, and the number of bytes stored contiguously
+ * from there before the arena wraps
+ */
+#define aesd_circular_buffer_arena_ptr(buffer, stream_offs) (&(buffer)->arena[(stream_offs) & (buffer)->arena_mask])
+#define aesd_circular_buffer_arena_contig(buffer, stream_offs) \
+    ((buffer)->arena_mask + 1 - ((stream_offs) & (buffer)->arena_mask))
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -78,7 +187,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -0,0 +1,476 @@
+/**
+ * @file aesd-circular-buffer.hpp
+ * @brief Header only C++ version of aesd-circular-buffer.c for in-process users
+ *
+ * aesd::circular_buffer<T, N> keeps the semantics of struct aesd_circular_buffer: up to N entries,
+ * the oldest one overwritten and handed back when a new one arrives while full, and character
+ * offset lookups across all entries concatenated end to end. The capacity is a template argument,
+ * so the slot count and index mask are compile time constants and the ring needs no allocation.
+ * Entries are stored by value: a span type like std::string_view references caller owned bytes
+ * as buffptr does, an owning type like aesd::owned_entry moves the bytes in and out of the ring.
+ * Stored entries are only reachable as const: the ring caches the stream offset of every entry,
+ * and changing the size of an entry in place would leave offset lookups pointing at wrong ones.
+ */
+
+#ifndef AESD_CIRCULAR_BUFFER_HPP
+#define AESD_CIRCULAR_BUFFER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+namespace aesd
+{
+
+/**
+ * Number of bytes an entry holds, std::size() unless specialized for T
+ */
+template <typename T, typename = void>
+struct entry_traits
+{
+    static std::size_t size(const T &entry)
+    {
+        return std::size(entry);
+    }
+};
+
+/**
+ * Move only entry owning a heap copy of its bytes, the C++ counterpart of a kmalloc'd buffptr
+ */
+class owned_entry
+{
+public:
+    owned_entry() noexcept = default;
+
+    owned_entry(const char *data, std::size_t size)
+        : data_(size != 0 ? new char[size] : nullptr), size_(size)
+    {
+        if (size != 0)
+        {
+            std::memcpy(data_.get(), data, size);
+        }
+    }
+
+    owned_entry(owned_entry &&other) noexcept
+        : data_(std::move(other.data_)), size_(std::exchange(other.size_, 0))
+    {
+    }
+
+    owned_entry &operator=(owned_entry &&other) noexcept
+    {
+        data_ = std::move(other.data_);
+        size_ = std::exchange(other.size_, 0);
+        return *this;
+    }
+
+    owned_entry(const owned_entry &) = delete;
+    owned_entry &operator=(const owned_entry &) = delete;
+
+    const char *data() const noexcept
+    {
+        return data_.get();
+    }
+
+    std::size_t size() const noexcept
+    {
+        return size_;
+    }
+
+private:
+    std::unique_ptr<char[]> data_;
+    std::size_t size_ = 0;
+};
+
+namespace detail
+{
+
+constexpr std::uint32_t slots_for(std::uint32_t capacity)
+{
+    std::uint32_t slots = 1;
+    while (slots < capacity)
+    {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+} // namespace detail
+
+/**
+ * Ring of the N most recent entries of type T, see the file comment. Not copyable or movable,
+ * entries live in place inside the object. Element access is const only, so iterator is
+ * const_iterator: to change an entry, pop() it and push() the new one. Any necessary locking must
+ * be handled by the caller.
+ */
+template <typename T, std::uint32_t N>
+class circular_buffer
+{
+    static_assert(N > 0 && N <= (1U << 31), "capacity must be between 1 and 2^31");
+
+public:
+    class const_iterator;
+
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = const T &;
+    using const_reference = const T &;
+    using iterator = const_iterator;
+
+    /**
+     * Slots backing the capacity, a power of two so indices wrap with slot_mask
+     */
+    static constexpr std::uint32_t slot_count = detail::slots_for(N);
+    static constexpr std::uint32_t slot_mask = slot_count - 1;
+
+    circular_buffer() noexcept = default;
+    circular_buffer(const circular_buffer &) = delete;
+    circular_buffer &operator=(const circular_buffer &) = delete;
+
+    ~circular_buffer()
+    {
+        clear();
+    }
+
+    static constexpr size_type capacity() noexcept
+    {
+        return N;
+    }
+
+    size_type size() const noexcept
+    {
+        return in_offs_ - out_offs_;
+    }
+
+    bool empty() const noexcept
+    {
+        return in_offs_ == out_offs_;
+    }
+
+    bool full() const noexcept
+    {
+        return size() == N;
+    }
+
+    /**
+     * Bytes of all stored entries
+     */
+    size_type total_size() const noexcept
+    {
+        return total_size_;
+    }
+
+    /**
+     * Bytes of every entry ever added, the stream offset the next entry starts at
+     */
+    size_type stream_offs() const noexcept
+    {
+        return stream_offs_;
+    }
+
+    /**
+     * Adds @param entry after the newest one.
+     * @return the oldest entry if it was overwritten to make room, which the caller now owns
+     */
+    std::optional<T> push(T entry)
+    {
+        return emplace(std::move(entry));
+    }
+
+    /**
+     * Constructs an entry from @param args after the newest one, see push()
+     */
+    template <typename... Args>
+    std::optional<T> emplace(Args &&...args)
+    {
+        std::optional<T> evicted;
+        if (full())
+        {
+            evicted = pop();
+        }
+        const std::uint32_t slot = in_offs_ & slot_mask;
+        T *entry = ::new (static_cast<void *>(&slots_[slot])) T(std::forward<Args>(args)...);
+        const size_type size = entry_traits<T>::size(*entry);
+        slot_stream_offs_[slot] = stream_offs_;
+        in_offs_++;
+        total_size_ += size;
+        stream_offs_ += size;
+        return evicted;
+    }
+
+    /**
+     * Removes the oldest entry.
+     * @return the entry, or nothing when the buffer is empty
+     */
+    std::optional<T> pop()
+    {
+        if (empty())
+        {
+            return std::nullopt;
+        }
+        T *entry = slot(out_offs_);
+        std::optional<T> evicted(std::move(*entry));
+        total_size_ -= entry_traits<T>::size(*evicted);
+        entry->~T();
+        out_offs_++;
+        return evicted;
+    }
+
+    void clear() noexcept
+    {
+        for (; out_offs_ != in_offs_; out_offs_++)
+        {
+            slot(out_offs_)->~T();
+        }
+        total_size_ = 0;
+    }
+
+    /**
+     * The entry @param index positions after the oldest one
+     */
+    const_reference operator[](size_type index) const noexcept
+    {
+        return *slot(out_offs_ + static_cast<std::uint32_t>(index));
+    }
+
+    const_reference front() const noexcept
+    {
+        return (*this)[0];
+    }
+
+    const_reference back() const noexcept
+    {
+        return (*this)[size() - 1];
+    }
+
+    const_iterator begin() const noexcept
+    {
+        return const_iterator(this, out_offs_);
+    }
+
+    const_iterator end() const noexcept
+    {
+        return const_iterator(this, in_offs_);
+    }
+
+    const_iterator cbegin() const noexcept
+    {
+        return begin();
+    }
+
+    const_iterator cend() const noexcept
+    {
+        return end();
+    }
+
+    /**
+     * Character offset of the first byte of the entry @param index positions after the oldest one,
+     * counted from the start of the oldest entry
+     */
+    size_type entry_fpos(size_type index) const noexcept
+    {
+        return slot_stream_offs_[(out_offs_ + static_cast<std::uint32_t>(index)) & slot_mask] -
+               (stream_offs_ - total_size_);
+    }
+
+    /**
+     * Finds the entry holding character @param char_offset of all entries concatenated end to end,
+     * with a binary search over the entry offsets like aesd_circular_buffer_find_index_for_fpos().
+     * @return the entry and the offset of char_offset within it, or end() when not enough data is
+     * stored
+     */
+    std::pair<const_iterator, size_type> find_fpos(size_type char_offset) const noexcept
+    {
+        // binary search for the last entry starting at or before char_offset, which can't be
+        // empty unless char_offset is past the end, handled up front
+        std::uint32_t low = 0;
+        std::uint32_t high = static_cast<std::uint32_t>(size());
+        if (char_offset >= total_size_)
+        {
+            return {end(), 0};
+        }
+        while (high - low > 1)
+        {
+            const std::uint32_t middle = low + (high - low) / 2;
+            if (entry_fpos(middle) <= char_offset)
+            {
+                low = middle;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        return {const_iterator(this, out_offs_ + low), char_offset - entry_fpos(low)};
+    }
+
+private:
+    // lets the tests move the free running indices of an empty ring close to their wrap
+    friend struct circular_buffer_test;
+
+    T *slot(std::uint32_t index) noexcept
+    {
+        return std::launder(reinterpret_cast<T *>(&slots_[index & slot_mask]));
+    }
+
+    const T *slot(std::uint32_t index) const noexcept
+    {
+        return std::launder(reinterpret_cast<const T *>(&slots_[index & slot_mask]));
+    }
+
+    // uninitialized storage, only the slots of indices from out_offs_ up to in_offs_ hold a T
+    struct alignas(T) storage
+    {
+        unsigned char bytes[sizeof(T)];
+    };
+
+    storage slots_[slot_count];
+    // stream offset of the first byte of the entry in each slot, the prefix sums find_fpos searches
+    size_type slot_stream_offs_[slot_count];
+    // free running indices of the newest entry plus one and of the oldest entry
+    std::uint32_t in_offs_ = 0;
+    std::uint32_t out_offs_ = 0;
+    size_type total_size_ = 0;
+    size_type stream_offs_ = 0;
+};
+
+/**
+ * Random access iterator over the stored entries, oldest first. Holds a free running index, so
+ * it stays on the same entry while newer ones are added, until that entry is evicted.
+ */
+template <typename T, std::uint32_t N>
+class circular_buffer<T, N>::const_iterator
+{
+public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = const T &;
+
+    const_iterator() noexcept = default;
+
+    reference operator*() const noexcept
+    {
+        return *buffer_->slot(index_);
+    }
+
+    pointer operator->() const noexcept
+    {
+        return buffer_->slot(index_);
+    }
+
+    reference operator[](difference_type n) const noexcept
+    {
+        return *(*this + n);
+    }
+
+    const_iterator &operator++() noexcept
+    {
+        index_++;
+        return *this;
+    }
+
+    const_iterator operator++(int) noexcept
+    {
+        const_iterator old = *this;
+        index_++;
+        return old;
+    }
+
+    const_iterator &operator--() noexcept
+    {
+        index_--;
+        return *this;
+    }
+
+    const_iterator operator--(int) noexcept
+    {
+        const_iterator old = *this;
+        index_--;
+        return old;
+    }
+
+    const_iterator &operator+=(difference_type n) noexcept
+    {
+        index_ += static_cast<std::uint32_t>(n);
+        return *this;
+    }
+
+    const_iterator &operator-=(difference_type n) noexcept
+    {
+        index_ -= static_cast<std::uint32_t>(n);
+        return *this;
+    }
+
+    friend const_iterator operator+(const_iterator it, difference_type n) noexcept
+    {
+        return it += n;
+    }
+
+    friend const_iterator operator+(difference_type n, const_iterator it) noexcept
+    {
+        return it += n;
+    }
+
+    friend const_iterator operator-(const_iterator it, difference_type n) noexcept
+    {
+        return it -= n;
+    }
+
+    // positions are compared relative to the oldest entry, free running indices wrap
+    friend difference_type operator-(const const_iterator &a, const const_iterator &b) noexcept
+    {
+        return static_cast<std::int32_t>(a.index_ - b.index_);
+    }
+
+    friend bool operator==(const const_iterator &a, const const_iterator &b) noexcept
+    {
+        return a.index_ == b.index_;
+    }
+
+    friend bool operator!=(const const_iterator &a, const const_iterator &b) noexcept
+    {
+        return a.index_ != b.index_;
+    }
+
+    friend bool operator<(const const_iterator &a, const const_iterator &b) noexcept
+    {
+        return a - b < 0;
+    }
+
+    friend bool operator>(const const_iterator &a, const const_iterator &b) noexcept
+    {
+        return b < a;
+    }
+
+    friend bool operator<=(const const_iterator &a, const const_iterator &b) noexcept
+    {
+        return !(b < a);
+    }
+
+    friend bool operator>=(const const_iterator &a, const const_iterator &b) noexcept
+    {
+        return !(a < b);
+    }
+
+private:
+    friend class circular_buffer;
+
+    const_iterator(const circular_buffer *buffer, std::uint32_t index) noexcept
+        : buffer_(buffer), index_(index)
+    {
+    }
+
+    const circular_buffer *buffer_ = nullptr;
+    std::uint32_t index_ = 0;
+};
+
+} // namespace aesd
+
+#endif /* AESD_CIRCULAR_BUFFER_HPP */
@@ -33,14 +33,160 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * One stored write command as reported by AESDCHAR_IOCGENTRIES
+ */
+struct aesd_entry_info {
+    /**
+     * Number of write commands stored before this one since the module was loaded, the value
+     * AESDCHAR_IOCSEEKSINCE takes. Consecutive entries have consecutive sequences.
+     */
+    uint64_t sequence;
+    /**
+     * Position of the first byte of the command, as used by lseek and read
+     */
+    uint64_t offset;
+    uint64_t size;
+};
+
+/**
+ * Argument of AESDCHAR_IOCGENTRIES. The driver fills the user array at entries with up to
+ * max_entries entries, oldest first, and sets count to the number filled and total to the number
+ * of entries stored. total > count means the array was too small.
+ */
+struct aesd_entries {
+    /**
+     * User space address of an array of max_entries struct aesd_entry_info
+     */
+    uint64_t entries;
+    uint32_t max_entries;
+    uint32_t count;
+    uint32_t total;
+    uint32_t reserved;
+};
+
+/**
+ * Device counters returned by AESDCHAR_IOCGSTATS
+ */
+struct aesd_stats {
+    /**
+     * Bytes of the stored commands, which is also the end position for lseek
+     */
+    uint64_t total_size;
+    /**
+     * Bytes of every command written since the module was loaded
+     */
+    uint64_t written_bytes;
+    /**
+     * Bytes of the commands dropped to make room for newer ones
+     */
+    uint64_t evicted_bytes;
+    /**
+     * Commands written and commands dropped since the module was loaded, both wrap at 2^32
+     */
+    uint32_t written_entries;
+    uint32_t evicted_entries;
+    uint32_t entry_count;
+    uint32_t capacity;
+    /**
+     * Limits the device was loaded with, 0 when not set
+     */
+    uint64_t byte_budget;
+    uint64_t arena_size;
+};
+
+/**
+ * Argument of AESDCHAR_IOCSEEKSINCE
+ */
+struct aesd_seek_since {
+    /**
+     * AESD_SEEK_SINCE_TIME or AESD_SEEK_SINCE_SEQUENCE, selecting what value holds
+     */
+    uint32_t by;
+    uint32_t reserved;
+    /**
+     * A CLOCK_MONOTONIC time in nanoseconds, or the sequence of a write command as reported in
+     * aesd_entry_info.sequence
+     */
+    uint64_t value;
+    /**
+     * Set by the driver to the sequence of the command the file position is now at
+     */
+    uint64_t sequence;
+    /**
+     * Set by the driver to the new file position
+     */
+    uint64_t offset;
+};
+
+#define AESD_SEEK_SINCE_TIME 0
+#define AESD_SEEK_SINCE_SEQUENCE 1
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Takes a pointer to a uint32_t, non zero makes reads of this open file wait for new write
+ * commands at the end of the data instead of returning 0, or fail with EAGAIN for O_NONBLOCK.
+ * Reading continues with the first command written after the end was reached.
+ */
+#define AESDCHAR_IOCTAILMODE _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+/**
+ * Takes a pointer to a struct aesd_entries and fills in the position of every stored command with
+ * one consistent snapshot, so userspace can index the device with a single call
+ */
+#define AESDCHAR_IOCGENTRIES _IOWR(AESD_IOC_MAGIC, 3, struct aesd_entries)
+/**
+ * Takes a pointer to a struct aesd_stats to fill in
+ */
+#define AESDCHAR_IOCGSTATS _IOR(AESD_IOC_MAGIC, 4, struct aesd_stats)
+/**
+ * Takes a pointer to a struct aesd_seek_since and moves the file position to the oldest stored
+ * command written at or after the given time, or to the command with the given sequence (the
+ * oldest stored one if it was evicted already). When no such command is stored yet the position
+ * moves to the end, and sequence is the one the next write command will get.
+ */
+#define AESDCHAR_IOCSEEKSINCE _IOWR(AESD_IOC_MAGIC, 5, struct aesd_seek_since)
+/**
+ * Start of a read only mmap of the device, which is available when the driver keeps the write
+ * commands in an arena (aesd_arena_size module parameter). The header is followed by the index,
+ * slots entries of struct aesd_mmap_entry, and the arena at arena_offset from the start of the
+ * mapping. Byte s of the stream is at arena[s & (arena_size - 1)].
+ *
+ * The commands stored are the index entries from out_offs up to in_offs, both free running, the
+ * entry of index i is at slot i & (slots - 1). The driver changes header, index and the bytes of
+ * stored commands only while sequence is odd. Readers load sequence, wait for it to be even, copy what they need and
+ * load sequence again after an acquire fence, starting over when it changed.
+ */
+struct aesd_mmap_header {
+    uint32_t sequence;
+    uint32_t slots;
+    uint32_t in_offs;
+    uint32_t out_offs;
+    /**
+     * Stream offset behind the newest stored command
+     */
+    uint64_t stream_offs;
+    uint64_t arena_offset;
+    /**
+     * Bytes of the arena, a power of two
+     */
+    uint64_t arena_size;
+};
+
+struct aesd_mmap_entry {
+    /**
+     * Stream offset of the first byte of the command
+     */
+    uint64_t stream_offs;
+    uint64_t size;
+};
+
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 5
 
 #endif /* AESD_IOCTL_H */
@@ -8,7 +8,7 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1 // Remove comment on this line to enable debug
+//#define AESD_DEBUG 1 // Remove comment on this line to enable debug, or build with AESD_DEBUG=y
 
 #undef PDEBUG /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -25,18 +25,121 @@
 
 #include "aesd-circular-buffer.h"
 #include <linux/sem.h>
+#include <linux/cache.h>
+#include <linux/llist.h>
 
+/**
+ * Commands up to 4096 bytes come from kmem caches of 64, 256, 1024 and 4096 byte payloads,
+ * larger ones from kmalloc
+ */
+#define AESD_COMMAND_CLASSES 4
+#define AESD_COMMAND_KMALLOC AESD_COMMAND_CLASSES
+#define aesd_command_class_size(size_class) ((size_t)64 << (2 * (size_class)))
+
+/**
+ * Events counted per CPU for every device, summed up when read through debugfs
+ */
+enum aesd_counter
+{
+     AESD_COUNT_READS,
+     AESD_COUNT_READ_BYTES,
+     AESD_COUNT_WRITES,
+     AESD_COUNT_WRITE_BYTES,
+     AESD_COUNT_EVICTIONS,
+     AESD_COUNT_EVICTED_BYTES,
+     // writes leaving a command without its newline behind, for later writes to complete
+     AESD_COUNT_PARTIAL_WRITES,
+     // buffer_mutex acquisitions which had to wait, and the nanoseconds spent waiting
+     AESD_COUNT_MUTEX_WAITS,
+     AESD_COUNT_MUTEX_WAIT_NS,
+     // reads which couldn't continue from the cursor and searched for their position
+     AESD_COUNT_SEEK_MISSES,
+     // command buffers allocated, the nanoseconds spent, and how many came from the stash
+     AESD_COUNT_COMMAND_ALLOCS,
+     AESD_COUNT_COMMAND_ALLOC_NS,
+     AESD_COUNT_STASH_HITS,
+     AESD_COUNTERS
+};
+
+struct aesd_counters
+{
+     u64 count[AESD_COUNTERS];
+};
+
+// devices are allocated as one array, the alignment keeps the locks of neighbours apart
 struct aesd_dev
 {
      /**
       * TODO: Add structure(s) and locks needed to complete assignment requirements
       */
      struct aesd_circular_buffer buffer;
-     // mutex for buffer
+     // serializes writers, which also hold buffer_seq in write mode while changing buffer
      struct mutex buffer_mutex;
+     // readers snapshot buffer without the mutex and retry when this changed meanwhile
+     seqcount_mutex_t buffer_seq;
+     // woken whenever a write commits commands, for tail mode readers and poll
+     wait_queue_head_t commit_wait;
+     // start of the vmalloc_user area userspace can mmap, holding a mirror of buffer followed by
+     // buffer.arena. NULL without an arena
+     struct aesd_mmap_header *mmap_header;
+     struct aesd_counters __percpu *counters;
+     // evicted command buffers per size class, filled after their grace period and reused by
+     // the next writes. Only writers holding buffer_mutex take from them
+     struct llist_head command_stash[AESD_COMMAND_CLASSES];
+     atomic_t command_stashed[AESD_COMMAND_CLASSES];
      struct cdev cdev; /* Char device structure      */
      char * write_buffer;
+     // bytes of the command being written, copied to buffer.arena once complete when there is one
      size_t write_buffer_size;
+     // bytes allocated for write_buffer, grown geometrically while a command is being written
+     size_t write_buffer_capacity;
+} ____cacheline_aligned_in_smp;
+
+/**
+ * Allocation behind the buffptr of a stored command, released after an RCU grace period since
+ * readers may still be copying from it
+ */
+struct aesd_command
+{
+     union
+     {
+          struct rcu_head rcu;
+          // links the command into the stash of its device once the grace period is over
+          struct llist_node stash;
+     };
+     struct aesd_dev *dev;
+     // index into the command caches, or AESD_COMMAND_KMALLOC
+     unsigned int size_class;
+     // bytes data can hold
+     unsigned int capacity;
+     char data[];
+};
+
+/**
+ * State of one open file, kept in filp->private_data
+ */
+struct aesd_file
+{
+     struct aesd_dev *dev;
+     // serializes reads of this file, which share the cursor and bounce buffer
+     struct mutex read_mutex;
+     // reads copy a snapshot of the buffer here before copy_to_user, allocated by the first read
+     char *bounce;
+     // the last read stopped at cursor_fpos, which is cursor_offset bytes into the entry at free
+     // running index cursor_index, so a read continuing from there needs no lookup
+     bool cursor_valid;
+     loff_t cursor_fpos;
+     uint32_t cursor_index;
+     size_t cursor_offset;
+     // buffer.out_offs when the cursor was taken. It advances with every eviction, which shifts
+     // all positions, so it serves as the buffer generation
+     uint32_t cursor_generation;
+     // set by AESDCHAR_IOCTAILMODE, reads at the end of the data wait for new commands
+     bool tail;
+     // the last tail mode read left f_pos at tail_fpos, which was stream offset tail_stream
+     bool tail_valid;
+     loff_t tail_fpos;
+     size_t tail_stream;
 };
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -18,23 +18,115 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
+#include <linux/mm.h> // kvcalloc
+#include <linux/moduleparam.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/llist.h>
+#include <linux/version.h>
 #include "aesdchar.h"
 
 #include "aesd_ioctl.h"
 int aesd_major = 0; // use dynamic major
 int aesd_minor = 0;
 
+// smallest allocation for a partial command, later growth doubles it
+#define AESD_WRITE_BUFFER_MIN_CAPACITY 64
+
+// bytes a reader copies per snapshot of the buffer, and entries a snapshot covers at most
+#define AESD_READ_BOUNCE_SIZE PAGE_SIZE
+#define AESD_READ_PIECES 32
+
+// evicted command buffers a device keeps per size class for reuse
+#define AESD_COMMAND_STASH_MAX 64
+
+// adds n to one of the per CPU counters of dev
+#define aesd_count(dev, counter, n) this_cpu_add((dev)->counters->count[counter], (n))
+
+static const char *const aesd_counter_names[AESD_COUNTERS] = {
+    [AESD_COUNT_READS] = "reads",
+    [AESD_COUNT_READ_BYTES] = "read_bytes",
+    [AESD_COUNT_WRITES] = "writes",
+    [AESD_COUNT_WRITE_BYTES] = "write_bytes",
+    [AESD_COUNT_EVICTIONS] = "evictions",
+    [AESD_COUNT_EVICTED_BYTES] = "evicted_bytes",
+    [AESD_COUNT_PARTIAL_WRITES] = "partial_writes",
+    [AESD_COUNT_MUTEX_WAITS] = "mutex_waits",
+    [AESD_COUNT_MUTEX_WAIT_NS] = "mutex_wait_ns",
+    [AESD_COUNT_SEEK_MISSES] = "seek_misses",
+    [AESD_COUNT_COMMAND_ALLOCS] = "command_allocs",
+    [AESD_COUNT_COMMAND_ALLOC_NS] = "command_alloc_ns",
+    [AESD_COUNT_STASH_HITS] = "stash_hits",
+};
+
+static const char *const aesd_command_cache_names[AESD_COMMAND_CLASSES] = {
+    "aesd_command_64",
+    "aesd_command_256",
+    "aesd_command_1024",
+    "aesd_command_4096",
+};
+static struct kmem_cache *aesd_command_caches[AESD_COMMAND_CLASSES];
+
+// debugfs directory holding one counters file per device
+static struct dentry *aesd_debugfs_dir;
+
+struct aesd_read_piece
+{
+    const char *src;
+    size_t size;
+};
+
+// number of write commands the device keeps, backed by a power of two number of slots
+static unsigned int aesd_capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(aesd_capacity, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_capacity, "Number of write commands kept by the device (default 10)");
+
+// upper limit for the bytes of all kept write commands, oldest commands are dropped to stay within
+static unsigned long aesd_byte_budget = 0;
+module_param(aesd_byte_budget, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_byte_budget, "Bytes of write commands kept by the device, 0 for no limit (default 0)");
+
+// size of a ring all write commands are copied into, instead of one allocation per command
+static unsigned long aesd_arena_size = 0;
+module_param(aesd_arena_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_arena_size, "Bytes of the ring arena storing write commands, a power of two, 0 to allocate per command (default 0)");
+
+// independent devices, each with its own buffer and locks, so unrelated writers don't contend
+static unsigned int aesd_nr_devs = 1;
+module_param(aesd_nr_devs, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of devices /dev/aesdchar0..N-1 created (default 1)");
+
+// size class caches for command buffers, off to allocate every command with kmalloc
+static bool aesd_slab_caches = true;
+module_param(aesd_slab_caches, bool, S_IRUGO);
+MODULE_PARM_DESC(aesd_slab_caches, "Allocate commands up to 4096 bytes from size class caches (default true)");
+
 MODULE_AUTHOR("Aleksandr Vinogradov");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices;
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
-    struct aesd_dev *dev;
+    struct aesd_file *file;
     PDEBUG("open");
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (file == NULL)
+    {
+        PDEBUG("Error allocating file state");
+        return -ENOMEM;
+    }
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    mutex_init(&file->read_mutex);
+    filp->private_data = file;
     filp->f_pos = 0;
 
     return 0;
@@ -42,204 +134,793 @@ int aesd_open(struct inode *inode, struct file *filp)
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
     PDEBUG("release");
+    mutex_destroy(&file->read_mutex);
+    kfree(file->bounce);
+    kfree(file);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                  loff_t *f_pos)
+// size class of a command buffer for @param size bytes
+static unsigned int aesd_command_class(size_t size)
+{
+    unsigned int size_class;
+    if (!aesd_slab_caches)
+    {
+        return AESD_COMMAND_KMALLOC;
+    }
+    for (size_class = 0; size_class < AESD_COMMAND_CLASSES; size_class++)
+    {
+        if (size <= aesd_command_class_size(size_class))
+        {
+            return size_class;
+        }
+    }
+    return AESD_COMMAND_KMALLOC;
+}
+
+/**
+ * Allocates a command buffer of @param dev for @param size bytes, preferring a buffer of the
+ * same size class evicted earlier. The buffer mutex must be held by the caller.
+ */
+static struct aesd_command *aesd_command_alloc(struct aesd_dev *dev, size_t size)
+{
+    unsigned int size_class = aesd_command_class(size);
+    struct aesd_command *command;
+    struct llist_node *node;
+    u64 start = ktime_get_ns();
+    if (size_class == AESD_COMMAND_KMALLOC)
+    {
+        command = kmalloc(sizeof(struct aesd_command) + size, GFP_KERNEL);
+    }
+    else if ((node = llist_del_first(&dev->command_stash[size_class])) != NULL)
+    {
+        // the buffer mutex makes this the only consumer, as llist_del_first() requires
+        atomic_dec(&dev->command_stashed[size_class]);
+        command = llist_entry(node, struct aesd_command, stash);
+        aesd_count(dev, AESD_COUNT_STASH_HITS, 1);
+    }
+    else
+    {
+        command = kmem_cache_alloc(aesd_command_caches[size_class], GFP_KERNEL);
+    }
+    aesd_count(dev, AESD_COUNT_COMMAND_ALLOCS, 1);
+    aesd_count(dev, AESD_COUNT_COMMAND_ALLOC_NS, ktime_get_ns() - start);
+    if (command == NULL)
+    {
+        return NULL;
+    }
+    command->dev = dev;
+    command->size_class = size_class;
+    command->capacity = size_class == AESD_COMMAND_KMALLOC ? size : aesd_command_class_size(size_class);
+    return command;
+}
+
+// hand a command buffer back to its allocator
+static void aesd_command_release(struct aesd_command *command)
+{
+    if (command->size_class == AESD_COMMAND_KMALLOC)
+    {
+        kfree(command);
+    }
+    else
+    {
+        kmem_cache_free(aesd_command_caches[command->size_class], command);
+    }
+}
+
+// RCU callback of an evicted command, no reader can be copying from it anymore
+static void aesd_command_recycle(struct rcu_head *head)
+{
+    struct aesd_command *command = container_of(head, struct aesd_command, rcu);
+    struct aesd_dev *dev = command->dev;
+    unsigned int size_class = command->size_class;
+    if (size_class != AESD_COMMAND_KMALLOC)
+    {
+        if (atomic_inc_return(&dev->command_stashed[size_class]) <= AESD_COMMAND_STASH_MAX)
+        {
+            llist_add(&command->stash, &dev->command_stash[size_class]);
+            return;
+        }
+        atomic_dec(&dev->command_stashed[size_class]);
+    }
+    aesd_command_release(command);
+}
+
+/**
+ * Command buffers are released only after an RCU grace period, since readers copy from them
+ * without the buffer mutex. The rcu_head sits in front of the bytes entries point to.
+ * The buffer mutex of @param dev must be held by the caller.
+ * @return the bytes of a command buffer grown to hold @param size bytes, NULL on failure
+ */
+static char *aesd_command_realloc(struct aesd_dev *dev, char *data, size_t size)
+{
+    struct aesd_command *command = data != NULL ? container_of(data, struct aesd_command, data[0]) : NULL;
+    struct aesd_command *grown;
+    if (command != NULL && size <= command->capacity)
+    {
+        return data;
+    }
+    if (command != NULL && command->size_class == AESD_COMMAND_KMALLOC)
+    {
+        grown = krealloc(command, sizeof(struct aesd_command) + size, GFP_KERNEL);
+        if (grown != NULL)
+        {
+            grown->capacity = size;
+        }
+        return grown != NULL ? grown->data : NULL;
+    }
+    grown = aesd_command_alloc(dev, size);
+    if (grown == NULL)
+    {
+        return NULL;
+    }
+    if (command != NULL)
+    {
+        memcpy(grown->data, command->data, command->capacity);
+        aesd_command_release(command);
+    }
+    return grown->data;
+}
+
+// free a command buffer no reader can reach anymore
+static void aesd_command_free(const char *data)
+{
+    if (data != NULL)
+    {
+        aesd_command_release(container_of((char *)data, struct aesd_command, data[0]));
+    }
+}
+
+// free a command buffer readers may still be copying from, or keep it for reuse
+static void aesd_command_free_rcu(const char *data)
+{
+    if (data != NULL)
+    {
+        struct aesd_command *command = container_of((char *)data, struct aesd_command, data[0]);
+        call_rcu(&command->rcu, aesd_command_recycle);
+    }
+}
+
+/**
+ * Finds the entry holding @param f_pos like aesd_circular_buffer_find_index_for_fpos(), starting
+ * from the cursor of @param file when the previous read stopped right there and nothing was
+ * evicted since. Must be called within a buffer_seq read section or with the buffer mutex held.
+ * @param missed set when the cursor couldn't be used, counted by the caller once the section holds,
+ * so retried read sections don't count a miss each
+ */
+static int aesd_find_index_for_fpos(struct aesd_file *file, loff_t f_pos, uint32_t *index, size_t *entry_offset,
+                                    bool *missed)
+{
+    struct aesd_circular_buffer *buffer = &file->dev->buffer;
+    *missed = !(file->cursor_valid && file->cursor_fpos == f_pos && file->cursor_generation == buffer->out_offs);
+    if (!*missed)
+    {
+        *index = file->cursor_index;
+        *entry_offset = file->cursor_offset;
+        return 0;
+    }
+    return aesd_circular_buffer_find_index_for_fpos(buffer, f_pos, index, entry_offset);
+}
+
+/**
+ * Copies up to @param size bytes from @param f_pos on into the bounce buffer of @param file without
+ * taking the buffer mutex. A writer changing the buffer meanwhile makes the snapshot retry.
+ * Must be called within rcu_read_lock(), which keeps evicted commands allocated, and with the
+ * read mutex of the file held.
+ * @param stream_pos receives the stream offset of @param f_pos in the snapshot
+ * @param stream_end receives buffer.stream_offs of the snapshot
+ * @return number of bytes copied, 0 at the end of the data
+ */
+static size_t aesd_read_snapshot(struct aesd_file *file, size_t f_pos, size_t size, size_t *stream_pos,
+                                 size_t *stream_end)
+{
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    struct aesd_read_piece piece[AESD_READ_PIECES];
+    unsigned int pieces;
+    unsigned int i;
+    unsigned int seq;
+    bool found;
+    bool missed;
+    uint32_t index;
+    uint32_t out_offs;
+    size_t entry_offset;
+    size_t planned;
+    size_t copied;
+
+    if (buffer->arena != NULL)
+    {
+        // arena bytes are overwritten once evicted, so the copy itself has to be validated
+        do
+        {
+            size_t total_size;
+            size_t stream_offs;
+            seq = read_seqcount_begin(&dev->buffer_seq);
+            total_size = buffer->total_size;
+            *stream_end = buffer->stream_offs;
+            stream_offs = *stream_end - total_size + f_pos;
+            *stream_pos = stream_offs;
+            planned = f_pos < total_size ? min_t(size_t, size, total_size - f_pos) : 0;
+            for (copied = 0; copied < planned; copied += i)
+            {
+                i = min_t(size_t, planned - copied, aesd_circular_buffer_arena_contig(buffer, stream_offs + copied));
+                memcpy(file->bounce + copied, aesd_circular_buffer_arena_ptr(buffer, stream_offs + copied), i);
+            }
+        } while (read_seqcount_retry(&dev->buffer_seq, seq));
+        return planned;
+    }
+
+    // take a consistent snapshot of which bytes to copy first, the pointers of a torn one may be
+    // stale or mismatched with their sizes
+    do
+    {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        pieces = 0;
+        planned = 0;
+        out_offs = buffer->out_offs;
+        *stream_end = buffer->stream_offs;
+        *stream_pos = aesd_circular_buffer_first_stream_offs(buffer) + f_pos;
+        found = aesd_find_index_for_fpos(file, f_pos, &index, &entry_offset, &missed) == 0;
+        while (found && index != buffer->in_offs && planned < size && pieces < AESD_READ_PIECES)
+        {
+            const struct aesd_buffer_entry *entry = aesd_circular_buffer_slot(buffer, index);
+            const char *buffptr = READ_ONCE(entry->buffptr);
+            size_t entry_size = READ_ONCE(entry->size);
+            if (buffptr == NULL || entry_offset >= entry_size)
+            {
+                // only seen in a torn snapshot, which the retry discards
+                break;
+            }
+            piece[pieces].src = buffptr + entry_offset;
+            piece[pieces].size = min_t(size_t, size - planned, entry_size - entry_offset);
+            planned += piece[pieces].size;
+            entry_offset += piece[pieces].size;
+            pieces++;
+            if (entry_offset == entry_size)
+            {
+                index++;
+                entry_offset = 0;
+            }
+        }
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    if (missed)
+    {
+        aesd_count(dev, AESD_COUNT_SEEK_MISSES, 1);
+    }
+
+    // stored commands never change and evicted ones outlive the RCU read section
+    for (i = 0, copied = 0; i < pieces; copied += piece[i].size, i++)
+    {
+        memcpy(file->bounce + copied, piece[i].src, piece[i].size);
+    }
+    if (found)
+    {
+        // the cursor may end up at in_offs, commands written later continue from there
+        file->cursor_valid = true;
+        file->cursor_fpos = f_pos + planned;
+        file->cursor_index = index;
+        file->cursor_offset = entry_offset;
+        file->cursor_generation = out_offs;
+    }
+    return planned;
+}
+
+// whether commands were committed since buffer.stream_offs was @param stream_end
+static bool aesd_stream_moved(struct aesd_dev *dev, size_t stream_end)
+{
+    return READ_ONCE(dev->buffer.stream_offs) != stream_end;
+}
+
+/**
+ * @return the position of the byte at @param stream_offs, or 0 if it was evicted already
+ */
+static loff_t aesd_fpos_of_stream(struct aesd_dev *dev, size_t stream_offs)
+{
+    unsigned int seq;
+    size_t first;
+    do
+    {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        first = aesd_circular_buffer_first_stream_offs(&dev->buffer);
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    return (ssize_t)(stream_offs - first) < 0 ? 0 : stream_offs - first;
+}
+
+
+/**
+ * Reads into any kind of iov_iter, so read(), readv() and splicing the device into a pipe all
+ * copy straight from the bounce buffer to their destination
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t retval = 0;
-    struct aesd_dev *dev = filp->private_data;
-    size_t entry_offset_byte_rtn;
-    struct aesd_buffer_entry *entry;
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    size_t copied = 0;
     size_t bytes_to_copy;
+    size_t bytes_copied;
+    size_t stream_pos = 0;
+    size_t stream_end = 0;
+    bool tail = READ_ONCE(file->tail);
     PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
 
-    // lock mutex
-    if (mutex_lock_interruptible(&dev->buffer_mutex))
+    // readers of different files don't wait for each other or for writers, the mutex only guards
+    // the cursor and bounce buffer of this file
+    if (mutex_lock_interruptible(&file->read_mutex))
     {
         PDEBUG("Error locking mutex");
         return -ERESTARTSYS;
     }
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset_byte_rtn);
-    if (entry == NULL)
+    if (file->bounce == NULL)
     {
-        PDEBUG("entry is NULL. No data to read");
-        goto out;
+        file->bounce = kmalloc(AESD_READ_BOUNCE_SIZE, GFP_KERNEL);
+        if (file->bounce == NULL)
+        {
+            PDEBUG("Error allocating bounce buffer");
+            retval = -ENOMEM;
+            goto out;
+        }
     }
-    PDEBUG("Entry found");
-    bytes_to_copy = entry->size - entry_offset_byte_rtn;
-    if (bytes_to_copy > count)
+    // tail mode follows the stream offset where the last read stopped rather than f_pos, which
+    // evictions shift, unless the file was seeked since
+    if (tail && file->tail_valid && file->tail_fpos == *f_pos)
     {
-        bytes_to_copy = count;
+        *f_pos = aesd_fpos_of_stream(dev, file->tail_stream);
     }
-    PDEBUG("Bytes to copy: %zu", bytes_to_copy);
-
-    if (copy_to_user(buf, entry->buffptr + entry_offset_byte_rtn, bytes_to_copy))
+    file->tail_valid = false;
+    for (;;)
     {
-        PDEBUG("Error copying to user");
-        retval = -EFAULT;
-        goto out;
-    }
+        // fill as much of buf as the stored commands allow, not just the rest of one command
+        while (copied < count && *f_pos >= 0)
+        {
+            rcu_read_lock();
+            bytes_to_copy = aesd_read_snapshot(file, *f_pos, min_t(size_t, count - copied, AESD_READ_BOUNCE_SIZE),
+                                               &stream_pos, &stream_end);
+            rcu_read_unlock();
+            if (bytes_to_copy == 0)
+            {
+                break;
+            }
+            // copying to user memory may fault and sleep, so it runs outside of the snapshot
+            bytes_copied = copy_to_iter(file->bounce, bytes_to_copy, to);
+            *f_pos += bytes_copied;
+            copied += bytes_copied;
+            file->tail_stream = stream_pos + bytes_copied;
+            file->tail_valid = tail;
+            if (bytes_copied != bytes_to_copy)
+            {
+                PDEBUG("Error copying to user");
+                file->cursor_valid = false;
+                retval = -EFAULT;
+                goto out;
+            }
+        }
+        if (copied > 0 || count == 0 || !tail || *f_pos < 0)
+        {
+            break;
+        }
 
-    *f_pos += bytes_to_copy;
-    retval = bytes_to_copy;
+        // tail mode: wait for the next command instead of reporting the end of the data
+        file->tail_stream = stream_end;
+        file->tail_valid = true;
+        if (!aesd_stream_moved(dev, stream_end))
+        {
+            if (filp->f_flags & O_NONBLOCK)
+            {
+                retval = -EAGAIN;
+                goto out;
+            }
+            PDEBUG("Waiting for commands");
+            if (wait_event_interruptible(dev->commit_wait, aesd_stream_moved(dev, stream_end)))
+            {
+                retval = -ERESTARTSYS;
+                goto out;
+            }
+        }
+        // continue with the first command committed after the end
+        *f_pos = aesd_fpos_of_stream(dev, stream_end);
+    }
+    PDEBUG("Copied %zu bytes", copied);
 
 out:
-    // unlock mutex
-    mutex_unlock(&dev->buffer_mutex);
+    if (file->tail_valid)
+    {
+        file->tail_fpos = *f_pos;
+    }
+    // a fault after some bytes were copied still reports those bytes
+    if (copied > 0)
+    {
+        retval = copied;
+    }
+    mutex_unlock(&file->read_mutex);
+    aesd_count(dev, AESD_COUNT_READS, 1);
+    aesd_count(dev, AESD_COUNT_READ_BYTES, copied);
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                   loff_t *f_pos)
+/**
+ * Takes the buffer mutex of @param dev, accounting the time spent waiting when it is contended
+ * @return 0, or -ERESTARTSYS when interrupted while waiting
+ */
+static int aesd_lock_buffer(struct aesd_dev *dev)
+{
+    u64 start;
+    if (mutex_trylock(&dev->buffer_mutex))
+    {
+        return 0;
+    }
+    start = ktime_get_ns();
+    if (mutex_lock_interruptible(&dev->buffer_mutex))
+    {
+        return -ERESTARTSYS;
+    }
+    aesd_count(dev, AESD_COUNT_MUTEX_WAITS, 1);
+    aesd_count(dev, AESD_COUNT_MUTEX_WAIT_NS, ktime_get_ns() - start);
+    return 0;
+}
+
+/**
+ * Starts changing the buffer of @param dev, which readers and the mmap header must see as a
+ * write section. The buffer mutex must be held by the caller.
+ */
+static void aesd_write_begin(struct aesd_dev *dev)
+{
+    write_seqcount_begin(&dev->buffer_seq);
+    if (dev->mmap_header != NULL)
+    {
+        WRITE_ONCE(dev->mmap_header->sequence, dev->mmap_header->sequence + 1);
+        smp_wmb();
+    }
+}
+
+/**
+ * Ends the write section started by aesd_write_begin(), mirroring the entries added meanwhile
+ * into the index of the mmap header
+ */
+static void aesd_write_end(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    struct aesd_mmap_entry *index;
+    uint32_t i;
+    if (header != NULL)
+    {
+        index = (struct aesd_mmap_entry *)(header + 1);
+        for (i = header->in_offs; i != buffer->in_offs; i++)
+        {
+            index[i & buffer->mask].stream_offs = aesd_circular_buffer_slot(buffer, i)->stream_offs;
+            index[i & buffer->mask].size = aesd_circular_buffer_slot(buffer, i)->size;
+        }
+        header->in_offs = buffer->in_offs;
+        header->out_offs = buffer->out_offs;
+        header->stream_offs = buffer->stream_offs;
+        smp_wmb();
+        WRITE_ONCE(header->sequence, header->sequence + 1);
+    }
+    write_seqcount_end(&dev->buffer_seq);
+}
+
+/**
+ * Stores the command at @param buffptr of @param size bytes, allocated with aesd_command_realloc()
+ * and then owned by the circular buffer, freeing whatever it evicts. The buffer mutex must be held
+ * by the caller.
+ */
+static void aesd_add_command(struct aesd_dev *dev, const char *buffptr, size_t size)
+{
+    struct aesd_buffer_entry entry;
+    const char *old_buffer;
+    entry.buffptr = buffptr;
+    entry.size = size;
+    aesd_write_begin(dev);
+    while (aesd_circular_buffer_evict_for(&dev->buffer, entry.size, &old_buffer))
+    {
+        PDEBUG("Freeing old command");
+        aesd_command_free_rcu(old_buffer);
+    }
+    old_buffer = aesd_circular_buffer_add_entry(&dev->buffer, &entry);
+    aesd_write_end(dev);
+    if (old_buffer != NULL)
+    {
+        PDEBUG("Freeing old command");
+        aesd_command_free_rcu(old_buffer);
+    }
+}
+
+/**
+ * Copies the completed command at @param src of @param size bytes into the arena right behind the
+ * stored commands and stores it as an entry, evicting the oldest commands until it fits. Only
+ * completed commands make room, so an unfinished one never costs stored commands their place.
+ * The buffer mutex must be held by the caller.
+ * @param size at most the arena size
+ */
+static void aesd_add_arena_command(struct aesd_dev *dev, const char *src, size_t size)
+{
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    struct aesd_buffer_entry entry;
+    const char *old_buffer;
+    size_t contig = aesd_circular_buffer_arena_contig(buffer, buffer->stream_offs);
+    entry.buffptr = NULL;
+    entry.size = size;
+    aesd_write_begin(dev);
+    // evicting only releases arena bytes, there is nothing to free. Readers still copying them see
+    // the sequence change and retry, so the bytes can be overwritten right away
+    while (aesd_circular_buffer_evict_for(buffer, size, &old_buffer))
+    {
+    }
+    // the command wraps around the end of the arena if it doesn't fit before it
+    memcpy(aesd_circular_buffer_arena_ptr(buffer, buffer->stream_offs), src, min_t(size_t, size, contig));
+    if (size > contig)
+    {
+        memcpy(buffer->arena, src + contig, size - contig);
+    }
+    aesd_circular_buffer_add_entry(buffer, &entry);
+    aesd_write_end(dev);
+}
+
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
     ssize_t retval = -ENOMEM;
-    struct aesd_dev *dev = filp->private_data;
-    size_t offset = 0;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    size_t count = iov_iter_count(from);
+    size_t offset;
+    size_t start;
+    size_t scan;
     char *new_buffer;
     char *new_line;
-    struct aesd_buffer_entry entry;
-    const char *old_buffer;
-    PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
+    char *command;
+    size_t stream_start;
+    size_t evicted_start;
+    uint32_t out_start;
+    // the most bytes a single command may hold, 0 for no limit
+    size_t limit = dev->buffer.byte_budget;
+    bool too_big = false;
+    PDEBUG("write %zu bytes with offset %lld", count, iocb->ki_pos);
 
     // lock mutex
-    if (mutex_lock_interruptible(&dev->buffer_mutex))
+    if (aesd_lock_buffer(dev))
     {
         PDEBUG("Error locking mutex");
         return -ERESTARTSYS;
     }
+    stream_start = dev->buffer.stream_offs;
+    evicted_start = aesd_circular_buffer_first_stream_offs(&dev->buffer);
+    out_start = dev->buffer.out_offs;
 
-    // bad algorithm which allocate space each time
-    // copy old buffer to new one and free old one
     if (count <= 0)
     {
         PDEBUG("NO WRITE. Count is 0 or less");
         goto out;
     }
-
-    // allocate new buffer with size of old buffer + new data
-    new_buffer = kmalloc(dev->write_buffer_size + count, GFP_KERNEL);
-    if (new_buffer == NULL)
+    if (dev->buffer.arena != NULL && (limit == 0 || limit > dev->buffer.arena_mask))
     {
-        PDEBUG("Error allocating new buffer");
-        retval = -ENOMEM;
-        goto out;
+        // a command must fit the arena on its own
+        limit = dev->buffer.arena_mask + 1;
     }
-    if (dev->write_buffer != NULL)
+
+    // grow the partial command geometrically, so building it from many small writes copies each
+    // byte a constant number of times on average
+    if (count > dev->write_buffer_capacity - dev->write_buffer_size)
     {
-        PDEBUG("Old buffer is not NULL. Copying old buffer to new one");
-        // copy old buffer to new one
-        if (memcpy(new_buffer, dev->write_buffer, dev->write_buffer_size) == NULL)
+        size_t capacity = max_t(size_t, dev->write_buffer_capacity * 2, AESD_WRITE_BUFFER_MIN_CAPACITY);
+        if (capacity < dev->write_buffer_size + count)
         {
-            PDEBUG("Error copying old buffer to new one");
-            kfree(new_buffer);
-            retval = -EFAULT;
+            capacity = dev->write_buffer_size + count;
+        }
+        new_buffer = aesd_command_realloc(dev, dev->write_buffer, capacity);
+        if (new_buffer == NULL)
+        {
+            PDEBUG("Error allocating new buffer");
+            retval = -ENOMEM;
             goto out;
         }
-        offset = dev->write_buffer_size;
-        kfree(dev->write_buffer);
+        dev->write_buffer = new_buffer;
+        dev->write_buffer_capacity = capacity;
     }
-    dev->write_buffer = new_buffer;
-    dev->write_buffer_size += count;
 
     // copy data from user to buffer with offset
-    if (copy_from_user(dev->write_buffer + offset, buf, count))
+    offset = dev->write_buffer_size;
+    if (copy_from_iter(dev->write_buffer + offset, count, from) != count)
     {
         PDEBUG("Error copying from user");
         retval = -EFAULT;
         goto out;
     }
+    dev->write_buffer_size += count;
 
     retval = count;
 
-    // look for new line in buffer
-    new_line = memchr(dev->write_buffer, '\n', dev->write_buffer_size);
-    // if new line character found, add command to circular buffer until new line
-    if (new_line != NULL)
+    // every newline in the new data ends a command, the bytes written before hold none. The
+    // bytes after the last newline stay behind as the command being written
+    start = 0;
+    scan = offset;
+    while ((new_line = memchr(dev->write_buffer + scan, '\n', dev->write_buffer_size - scan)) != NULL)
     {
+        size_t end = new_line - dev->write_buffer + 1;
         PDEBUG("New line found");
-        entry.buffptr = dev->write_buffer;
-        entry.size = dev->write_buffer_size;
-        old_buffer = aesd_circular_buffer_add_entry(&dev->buffer, &entry);
-        if (old_buffer != NULL)
+        if (limit != 0 && end - start > limit)
+        {
+            too_big = true;
+            break;
+        }
+        if (dev->buffer.arena != NULL)
         {
-            PDEBUG("Freeing old command");
-            kfree(old_buffer);
+            aesd_add_arena_command(dev, dev->write_buffer + start, end - start);
         }
-        dev->write_buffer = NULL;
-        dev->write_buffer_size = 0;
+        else if (start == 0 && end == dev->write_buffer_size)
+        {
+            // a write completing a single command hands over the buffer without copying
+            aesd_add_command(dev, dev->write_buffer, end);
+            dev->write_buffer = NULL;
+            dev->write_buffer_size = 0;
+            dev->write_buffer_capacity = 0;
+            break;
+        }
+        else
+        {
+            command = aesd_command_realloc(dev, NULL, end - start);
+            if (command == NULL)
+            {
+                PDEBUG("Error allocating command");
+                // report the commands stored so far as a short write, so the rest can be written
+                // again, or drop this write's bytes when none was stored
+                retval = start == 0 ? -ENOMEM : (ssize_t)(start - offset);
+                dev->write_buffer_size = start == 0 ? offset : start;
+                break;
+            }
+            memcpy(command, dev->write_buffer + start, end - start);
+            aesd_add_command(dev, command, end - start);
+        }
+        start = end;
+        scan = end;
+    }
+    // a command which can never fit the budget would only hold memory past the limit, drop the
+    // part written so far too so later commands aren't rejected as well. The commands before it
+    // are kept and reported as a short write
+    if (too_big || (retval > 0 && limit != 0 && dev->write_buffer_size - start > limit))
+    {
+        PDEBUG("Command exceeds byte budget of %zu", limit);
+        retval = start == 0 ? -EFBIG : (ssize_t)(start - offset);
+        dev->write_buffer_size = start;
+    }
+    if (start > 0)
+    {
+        memmove(dev->write_buffer, dev->write_buffer + start, dev->write_buffer_size - start);
+        dev->write_buffer_size -= start;
     }
 
 out:
+    aesd_count(dev, AESD_COUNT_WRITES, 1);
+    aesd_count(dev, AESD_COUNT_WRITE_BYTES, retval > 0 ? retval : 0);
+    aesd_count(dev, AESD_COUNT_EVICTIONS, dev->buffer.out_offs - out_start);
+    aesd_count(dev, AESD_COUNT_EVICTED_BYTES, aesd_circular_buffer_first_stream_offs(&dev->buffer) - evicted_start);
+    if (retval > 0 && dev->write_buffer_size != 0)
+    {
+        aesd_count(dev, AESD_COUNT_PARTIAL_WRITES, 1);
+    }
     // unlock mutex
     mutex_unlock(&dev->buffer_mutex);
+    if (dev->buffer.stream_offs != stream_start)
+    {
+        wake_up_interruptible(&dev->commit_wait);
+    }
     return retval;
 }
 
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    unsigned int seq;
+    size_t total_size;
+
+    poll_wait(filp, &dev->commit_wait, wait);
+    do
+    {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        total_size = dev->buffer.total_size;
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    // a tail mode reader also finds commands committed after the stream offset it stopped at
+    if (filp->f_pos < total_size ||
+        (READ_ONCE(file->tail) && READ_ONCE(file->tail_valid) && READ_ONCE(file->tail_fpos) == filp->f_pos &&
+         aesd_stream_moved(dev, READ_ONCE(file->tail_stream))))
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
+
+/**
+ * Maps the header, index and arena of the device read only, see struct aesd_mmap_header
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    if (dev->mmap_header == NULL)
+    {
+        PDEBUG("mmap needs an arena");
+        return -ENODEV;
+    }
+    // userspace only reads, the arena keeps being overwritten by the driver
+    if (vma->vm_flags & VM_WRITE)
+    {
+        return -EPERM;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, dev->mmap_header, vma->vm_pgoff);
+}
 
 loff_t aesd_llseek(struct file * filp, loff_t f_pos, int seek)
 {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    unsigned int seq;
+    size_t total_size;
     PDEBUG("llseek with f_pos:%lld\n", f_pos);
     PDEBUG("llseek seek is %d\n", seek);
 
-    return fixed_size_llseek(filp, f_pos, seek, dev->buffer.total_size);
+    do
+    {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        total_size = dev->buffer.total_size;
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    return fixed_size_llseek(filp, f_pos, seek, total_size);
 }
 
 loff_t aesd_find_offset_of_command(struct aesd_circular_buffer * buffer, int command_index, int offset_in_command)
 {
-    int command_index_in_buffer = 0;
-    int index = 0;
     struct aesd_buffer_entry *entry;
-    loff_t offset = 0;
-    if(command_index < 0 || command_index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    if(command_index < 0 || command_index >= aesd_circular_buffer_count(buffer))
     {
         return -1;
     }
-    command_index_in_buffer = (buffer->out_offs + command_index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    if(buffer->entry[command_index_in_buffer].buffptr == NULL)
+    entry = aesd_circular_buffer_slot(buffer, buffer->out_offs + command_index);
+    if(offset_in_command < 0 || offset_in_command >= entry->size)
     {
         return -1;
     }
-    if(offset_in_command < 0 || offset_in_command >= buffer->entry[command_index_in_buffer].size)
-    {
-        return -1;
-    }
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index)
-    {
-        if(index == command_index_in_buffer)
-        {
-            return (loff_t)(offset + offset_in_command);
-        }
-        offset += entry->size;
-    }
-    return -1;
+    return aesd_circular_buffer_entry_fpos(buffer, buffer->out_offs + command_index) + offset_in_command;
 }
 
 
-long int aesd_ioctl(struct file * filp, unsigned int request, long unsigned int command)
+static long aesd_ioctl_seekto(struct file * filp, long unsigned int command)
 {
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
     loff_t offset;
+    size_t total_size;
+    unsigned int seq;
     struct aesd_seekto command_struct_local;
-    if(request != AESDCHAR_IOCSEEKTO)
-    {
-        PDEBUG("Wrong ioctl request");
-        return -EINVAL;
-    }
     if(copy_from_user(&command_struct_local, (const void __user*)command, sizeof(struct aesd_seekto)))
     {
         PDEBUG("Error copying from user");
         return -EFAULT;
     }
-    offset = aesd_find_offset_of_command(&aesd_device.buffer, command_struct_local.write_cmd, command_struct_local.write_cmd_offset);
+    // the offset and the size it is checked against come from the same snapshot
+    do
+    {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        offset = aesd_find_offset_of_command(&dev->buffer, command_struct_local.write_cmd, command_struct_local.write_cmd_offset);
+        total_size = dev->buffer.total_size;
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
     if(offset < 0)
     {
         PDEBUG("Error finding offset");
         return -EINVAL;
     }
-    if(aesd_llseek(filp, offset, SEEK_SET) < 0)
+    if(fixed_size_llseek(filp, offset, SEEK_SET, total_size) < 0)
     {
         PDEBUG("Error seeking");
         return -EINVAL;
@@ -248,19 +929,229 @@ long int aesd_ioctl(struct file * filp, unsigned int request, long unsigned int
     return 0;
 }
 
+static long aesd_ioctl_seeksince(struct file * filp, long unsigned int command)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    struct aesd_seek_since since;
+    uint32_t index;
+    loff_t offset;
+    size_t total_size;
+    unsigned int seq;
+    int found;
+    if(copy_from_user(&since, (const void __user*)command, sizeof(since)))
+    {
+        PDEBUG("Error copying from user");
+        return -EFAULT;
+    }
+    if(since.by != AESD_SEEK_SINCE_TIME && since.by != AESD_SEEK_SINCE_SEQUENCE)
+    {
+        PDEBUG("Wrong seek since kind %u", since.by);
+        return -EINVAL;
+    }
+    do
+    {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        if(since.by == AESD_SEEK_SINCE_TIME)
+        {
+            found = aesd_circular_buffer_find_index_for_time(buffer, since.value, &index);
+        }
+        else
+        {
+            found = aesd_circular_buffer_find_index_for_sequence(buffer, since.value, &index);
+        }
+        total_size = buffer->total_size;
+        if(found == 0)
+        {
+            offset = aesd_circular_buffer_entry_fpos(buffer, index);
+            since.sequence = aesd_circular_buffer_slot(buffer, index)->sequence;
+        }
+        else
+        {
+            // nothing stored is recent enough, reading continues with the next write
+            offset = total_size;
+            since.sequence = buffer->sequence;
+        }
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    if(fixed_size_llseek(filp, offset, SEEK_SET, total_size) < 0)
+    {
+        PDEBUG("Error seeking");
+        return -EINVAL;
+    }
+    since.offset = offset;
+    if(copy_to_user((void __user*)command, &since, sizeof(since)))
+    {
+        PDEBUG("Error copying to user");
+        return -EFAULT;
+    }
+    PDEBUG("ioctl seek since %llu to %lld", since.value, offset);
+    return 0;
+}
+
+static long aesd_ioctl_tailmode(struct file * filp, long unsigned int command)
+{
+    struct aesd_file *file = filp->private_data;
+    uint32_t enable;
+    if(copy_from_user(&enable, (const void __user*)command, sizeof(enable)))
+    {
+        PDEBUG("Error copying from user");
+        return -EFAULT;
+    }
+    WRITE_ONCE(file->tail, enable != 0);
+    PDEBUG("ioctl tail mode %u", enable);
+    return 0;
+}
+
+static long aesd_ioctl_entries(struct file * filp, long unsigned int command)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    struct aesd_entries entries;
+    struct aesd_entry_info *info = NULL;
+    const struct aesd_buffer_entry *entry;
+    uint32_t max_entries;
+    uint32_t out_offs;
+    uint32_t i;
+    size_t first;
+    unsigned int seq;
+    long retval = 0;
+    if(copy_from_user(&entries, (const void __user*)command, sizeof(entries)))
+    {
+        PDEBUG("Error copying from user");
+        return -EFAULT;
+    }
+    // the buffer never holds more than capacity entries, however large the user array
+    max_entries = min_t(uint32_t, entries.max_entries, buffer->capacity);
+    if(max_entries > 0)
+    {
+        info = kvmalloc_array(max_entries, sizeof(struct aesd_entry_info), GFP_KERNEL);
+        if(info == NULL)
+        {
+            PDEBUG("Error allocating %u entries", max_entries);
+            return -ENOMEM;
+        }
+    }
+    // copy_to_user may fault, so the table is snapshot into info first
+    do
+    {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        out_offs = buffer->out_offs;
+        first = aesd_circular_buffer_first_stream_offs(buffer);
+        entries.total = aesd_circular_buffer_count(buffer);
+        entries.count = min_t(uint32_t, entries.total, max_entries);
+        for(i = 0; i < entries.count; i++)
+        {
+            entry = aesd_circular_buffer_slot(buffer, out_offs + i);
+            info[i].sequence = READ_ONCE(entry->sequence);
+            info[i].offset = READ_ONCE(entry->stream_offs) - first;
+            info[i].size = READ_ONCE(entry->size);
+        }
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+
+    if((entries.count > 0 &&
+        copy_to_user(u64_to_user_ptr(entries.entries), info, entries.count * sizeof(struct aesd_entry_info))) ||
+       copy_to_user((void __user*)command, &entries, sizeof(entries)))
+    {
+        PDEBUG("Error copying to user");
+        retval = -EFAULT;
+    }
+    kvfree(info);
+    return retval;
+}
+
+static long aesd_ioctl_stats(struct file * filp, long unsigned int command)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    struct aesd_stats stats;
+    unsigned int seq;
+    memset(&stats, 0, sizeof(stats));
+    do
+    {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        stats.total_size = buffer->total_size;
+        stats.written_bytes = buffer->stream_offs;
+        stats.evicted_bytes = aesd_circular_buffer_first_stream_offs(buffer);
+        // both indices are free running, so they count every entry added and removed
+        stats.written_entries = buffer->in_offs;
+        stats.evicted_entries = buffer->out_offs;
+        stats.entry_count = aesd_circular_buffer_count(buffer);
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    stats.capacity = buffer->capacity;
+    stats.byte_budget = buffer->byte_budget;
+    stats.arena_size = buffer->arena != NULL ? buffer->arena_mask + 1 : 0;
+    if(copy_to_user((void __user*)command, &stats, sizeof(stats)))
+    {
+        PDEBUG("Error copying to user");
+        return -EFAULT;
+    }
+    return 0;
+}
+
+long int aesd_ioctl(struct file * filp, unsigned int request, long unsigned int command)
+{
+    switch(request)
+    {
+    case AESDCHAR_IOCSEEKTO:
+        return aesd_ioctl_seekto(filp, command);
+    case AESDCHAR_IOCTAILMODE:
+        return aesd_ioctl_tailmode(filp, command);
+    case AESDCHAR_IOCGENTRIES:
+        return aesd_ioctl_entries(filp, command);
+    case AESDCHAR_IOCGSTATS:
+        return aesd_ioctl_stats(filp, command);
+    case AESDCHAR_IOCSEEKSINCE:
+        return aesd_ioctl_seeksince(filp, command);
+    default:
+        PDEBUG("Wrong ioctl request");
+        return -EINVAL;
+    }
+}
+
 struct file_operations aesd_fops = {
     .owner = THIS_MODULE,
-    .read = aesd_read,
-    .write = aesd_write,
+    .read_iter = aesd_read_iter,
+    .write_iter = aesd_write_iter,
+    // splice and sendfile go through the iov_iter paths above instead of a user space buffer
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open = aesd_open,
     .release = aesd_release,
     .llseek = aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .poll = aesd_poll,
+    .mmap = aesd_mmap,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_counters_show(struct seq_file *s, void *unused)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    struct aesd_dev *dev = s->private;
+    int counter;
+    int cpu;
+    u64 sum;
+    for (counter = 0; counter < AESD_COUNTERS; counter++)
+    {
+        sum = 0;
+        for_each_possible_cpu(cpu)
+        {
+            sum += per_cpu_ptr(dev->counters, cpu)->count[counter];
+        }
+        seq_printf(s, "%s %llu\n", aesd_counter_names[counter], sum);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_counters);
+
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
+{
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -268,16 +1159,168 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
     err = cdev_add(&dev->cdev, devno, 1);
     if (err)
     {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %u", err, index);
     }
     return err;
 }
 
+/**
+ * Sets up the circular buffer, arena and locks of @param dev, then makes it available as minor
+ * aesd_minor + @param index
+ * @return 0 on success, a negative errno otherwise with nothing left to clean up
+ */
+static int aesd_init_dev(struct aesd_dev *dev, unsigned int index)
+{
+    int result;
+    uint32_t slots;
+    struct aesd_buffer_entry *entries;
+    struct aesd_mmap_header *header = NULL;
+    size_t arena_offset;
+    char name[24];
+
+    dev->counters = alloc_percpu(struct aesd_counters);
+    if (dev->counters == NULL)
+    {
+        return -ENOMEM;
+    }
+    dev->write_buffer = NULL;
+    dev->write_buffer_size = 0;
+    dev->write_buffer_capacity = 0;
+    slots = aesd_circular_buffer_slots_for(aesd_capacity);
+    entries = slots ? kvcalloc(slots, sizeof(struct aesd_buffer_entry), GFP_KERNEL) : NULL;
+    if (entries == NULL ||
+        aesd_circular_buffer_init_capacity(&(dev->buffer), entries, slots, aesd_capacity))
+    {
+        printk(KERN_WARNING "Can't set up capacity %u\n", aesd_capacity);
+        kvfree(entries);
+        free_percpu(dev->counters);
+        return entries == NULL ? -ENOMEM : -EINVAL;
+    }
+    dev->buffer.byte_budget = aesd_byte_budget;
+    if (aesd_arena_size != 0)
+    {
+        // the arena follows the header and index on the next page boundary, all of it mappable
+        arena_offset = PAGE_ALIGN(sizeof(struct aesd_mmap_header) + slots * sizeof(struct aesd_mmap_entry));
+        header = vmalloc_user(arena_offset + aesd_arena_size);
+        if (header == NULL ||
+            aesd_circular_buffer_set_arena(&(dev->buffer), (char *)header + arena_offset, aesd_arena_size))
+        {
+            printk(KERN_WARNING "Can't set up arena of %lu bytes\n", aesd_arena_size);
+            result = header == NULL ? -ENOMEM : -EINVAL;
+            goto fail;
+        }
+        header->slots = slots;
+        header->arena_offset = arena_offset;
+        header->arena_size = aesd_arena_size;
+        dev->mmap_header = header;
+    }
+    mutex_init(&(dev->buffer_mutex));
+    seqcount_mutex_init(&(dev->buffer_seq), &(dev->buffer_mutex));
+    init_waitqueue_head(&(dev->commit_wait));
+
+    result = aesd_setup_cdev(dev, index);
+
+    if (result)
+    {
+        mutex_destroy(&(dev->buffer_mutex));
+        goto fail;
+    }
+    // counters are only for inspection, the device works without its debugfs file
+    snprintf(name, sizeof(name), "aesdchar%u", index);
+    debugfs_create_file(name, 0444, aesd_debugfs_dir, dev, &aesd_counters_fops);
+    return 0;
+
+fail:
+    vfree(header);
+    kvfree(dev->buffer.entry);
+    free_percpu(dev->counters);
+    return result;
+}
+
+/**
+ * Removes the cdev of @param dev and frees every command it still holds
+ */
+static void aesd_cleanup_dev(struct aesd_dev *dev)
+{
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
+
+    cdev_del(&dev->cdev);
+
+    // free write_buffer if not null
+    aesd_command_free(dev->write_buffer);
+    // free every command still held by the circular buffer, evicted slots and arena entries are NULL
+    mutex_destroy(&(dev->buffer_mutex));
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index)
+    {
+        aesd_command_free(entry->buffptr);
+    }
+    kvfree(dev->buffer.entry);
+    vfree(dev->mmap_header);
+    free_percpu(dev->counters);
+}
+
+// give every stashed command buffer of @param dev back, after rcu_barrier() filled the stashes
+static void aesd_drain_stash(struct aesd_dev *dev)
+{
+    struct llist_node *node;
+    struct aesd_command *command;
+    struct aesd_command *next;
+    unsigned int size_class;
+    for (size_class = 0; size_class < AESD_COMMAND_CLASSES; size_class++)
+    {
+        node = llist_del_all(&dev->command_stash[size_class]);
+        llist_for_each_entry_safe(command, next, node, stash)
+        {
+            aesd_command_release(command);
+        }
+    }
+}
+
+static void aesd_destroy_command_caches(void)
+{
+    unsigned int size_class;
+    for (size_class = 0; size_class < AESD_COMMAND_CLASSES; size_class++)
+    {
+        kmem_cache_destroy(aesd_command_caches[size_class]);
+        aesd_command_caches[size_class] = NULL;
+    }
+}
+
+static int aesd_create_command_caches(void)
+{
+    unsigned int size_class;
+    if (!aesd_slab_caches)
+    {
+        return 0;
+    }
+    for (size_class = 0; size_class < AESD_COMMAND_CLASSES; size_class++)
+    {
+        aesd_command_caches[size_class] = kmem_cache_create(aesd_command_cache_names[size_class],
+                                                            sizeof(struct aesd_command) +
+                                                            aesd_command_class_size(size_class),
+                                                            0, 0, NULL);
+        if (aesd_command_caches[size_class] == NULL)
+        {
+            printk(KERN_WARNING "Can't create cache %s\n", aesd_command_cache_names[size_class]);
+            aesd_destroy_command_caches();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    unsigned int i;
+    if (aesd_nr_devs == 0)
+    {
+        printk(KERN_WARNING "aesd_nr_devs must be at least 1\n");
+        return -EINVAL;
+    }
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
                                  "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0)
@@ -285,54 +1328,70 @@ int aesd_init_module(void)
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device, 0, sizeof(struct aesd_dev));
-
-    aesd_device.write_buffer = NULL;
-    aesd_device.write_buffer_size = 0;
-    aesd_circular_buffer_init(&(aesd_device.buffer));
-    mutex_init(&(aesd_device.buffer_mutex));
-    PDEBUG("aesd charder inited");
+    result = aesd_create_command_caches();
+    if (result)
+    {
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return result;
+    }
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (aesd_devices == NULL)
+    {
+        aesd_destroy_command_caches();
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return -ENOMEM;
+    }
 
-    result = aesd_setup_cdev(&aesd_device);
+    aesd_debugfs_dir = debugfs_create_dir("aesdchar", NULL);
+    for (i = 0; i < aesd_nr_devs; i++)
+    {
+        result = aesd_init_dev(&aesd_devices[i], i);
+        if (result)
+        {
+            goto fail;
+        }
+    }
+    PDEBUG("aesd charder inited with %u devices", aesd_nr_devs);
+    return 0;
 
-    if (result)
+fail:
+    debugfs_remove_recursive(aesd_debugfs_dir);
+    while (i-- > 0)
     {
-        unregister_chrdev_region(dev, 1);
+        aesd_cleanup_dev(&aesd_devices[i]);
     }
+    kfree(aesd_devices);
+    aesd_destroy_command_caches();
+    unregister_chrdev_region(dev, aesd_nr_devs);
     return result;
 }
 
 void aesd_cleanup_module(void)
 {
-    const char *old_buffptr = NULL;
-    struct aesd_buffer_entry entry;
+    unsigned int i;
     dev_t devno;
 
     devno = MKDEV(aesd_major, aesd_minor);
 
-    cdev_del(&aesd_device.cdev);
-
-    // free write_buffer if not null
-    if (aesd_device.write_buffer != NULL)
+    // no counters file may be open while the devices are freed
+    debugfs_remove_recursive(aesd_debugfs_dir);
+    for (i = 0; i < aesd_nr_devs; i++)
     {
-        kfree(aesd_device.write_buffer);
+        aesd_cleanup_dev(&aesd_devices[i]);
     }
-    // free circular buffer by adding all entries to free list
-    entry.buffptr = NULL;
-    entry.size = 0;
-    mutex_destroy(&(aesd_device.buffer_mutex));
-    do
+    // commands evicted earlier may still wait for their grace period, their callbacks stash them
+    rcu_barrier();
+    for (i = 0; i < aesd_nr_devs; i++)
     {
-        old_buffptr = aesd_circular_buffer_add_entry(&(aesd_device.buffer), &entry);
-        if (old_buffptr == NULL)
-            break;
-        kfree(old_buffptr);
-    } while (1);
+        aesd_drain_stash(&aesd_devices[i]);
+    }
+    kfree(aesd_devices);
+    aesd_destroy_command_caches();
 
     PDEBUG("aesd chardev cleaned");
 
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 module_init(aesd_init_module);
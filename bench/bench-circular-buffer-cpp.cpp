@@ -0,0 +1,225 @@
+/**
+ * @file bench-circular-buffer-cpp.cpp
+ * @brief aesd::circular_buffer<T, N> against the C aesd_circular_buffer it mirrors
+ *
+ * Both rings get the same records of varying length. For each capacity the benchmark times adds
+ * into a full ring (each one evicting the oldest entry), a walk over all entries summing their
+ * sizes, and random fpos lookups, and checks both rings find the same entry for every lookup. The
+ * C ring is set up with aesd_circular_buffer_init_capacity() over a caller array, the C++ ring
+ * holds std::string_view entries, so neither allocates. C adds also read the clock for the entry
+ * timestamp, which the C++ ring leaves to its entry type.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include "aesd-circular-buffer.h"
+}
+#include "aesd-circular-buffer.hpp"
+
+namespace
+{
+
+constexpr int LOOKUPS = 200000;
+constexpr int ADDS = 2000000;
+// a power of two, so picking the record of add i costs both rings the same single mask
+constexpr std::size_t RECORDS = 4096;
+
+unsigned int seed = 1;
+// results feed this so the compiler can't drop them
+volatile std::size_t checksum;
+
+unsigned int next_random()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+unsigned long long now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct record
+{
+    const char *data;
+    std::size_t size;
+};
+
+struct results
+{
+    double add_ns;
+    double walk_ns;
+    double lookup_ns;
+};
+
+results bench_c(std::uint32_t capacity, const std::vector<record> &records, const std::vector<std::size_t> &offsets)
+{
+    aesd_circular_buffer buffer;
+    std::uint32_t slots = aesd_circular_buffer_slots_for(capacity);
+    std::vector<aesd_buffer_entry> entries(slots);
+    results r;
+
+    aesd_circular_buffer_init_capacity(&buffer, entries.data(), slots, capacity);
+    unsigned long long start = now_ns();
+    for (int i = 0; i < ADDS; i++)
+    {
+        aesd_buffer_entry entry;
+        entry.buffptr = records[i & (RECORDS - 1)].data;
+        entry.size = records[i & (RECORDS - 1)].size;
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    r.add_ns = double(now_ns() - start) / ADDS;
+
+    int walks = ADDS / capacity + 1;
+    start = now_ns();
+    for (int i = 0; i < walks; i++)
+    {
+        std::size_t sum = 0;
+        for (std::uint32_t index = buffer.out_offs; index != buffer.in_offs; index++)
+        {
+            sum += aesd_circular_buffer_slot(&buffer, index)->size;
+        }
+        checksum += sum;
+    }
+    r.walk_ns = double(now_ns() - start) / (double(walks) * capacity);
+
+    start = now_ns();
+    for (std::size_t offset : offsets)
+    {
+        std::size_t entry_offset;
+        aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset, &entry_offset);
+        checksum += entry_offset + entry->buffptr[entry_offset];
+    }
+    r.lookup_ns = double(now_ns() - start) / offsets.size();
+    return r;
+}
+
+template <std::uint32_t N>
+results bench_cpp(const std::vector<record> &records, const std::vector<std::size_t> &offsets)
+{
+    // too large for the stack at the bigger capacities
+    auto buffer = std::make_unique<aesd::circular_buffer<std::string_view, N>>();
+    results r;
+
+    unsigned long long start = now_ns();
+    for (int i = 0; i < ADDS; i++)
+    {
+        buffer->emplace(records[i & (RECORDS - 1)].data, records[i & (RECORDS - 1)].size);
+    }
+    r.add_ns = double(now_ns() - start) / ADDS;
+
+    int walks = ADDS / N + 1;
+    start = now_ns();
+    for (int i = 0; i < walks; i++)
+    {
+        std::size_t sum = 0;
+        for (std::string_view entry : *buffer)
+        {
+            sum += entry.size();
+        }
+        checksum += sum;
+    }
+    r.walk_ns = double(now_ns() - start) / (double(walks) * N);
+
+    start = now_ns();
+    for (std::size_t offset : offsets)
+    {
+        auto [entry, entry_offset] = buffer->find_fpos(offset);
+        checksum += entry_offset + (*entry)[entry_offset];
+    }
+    r.lookup_ns = double(now_ns() - start) / offsets.size();
+    return r;
+}
+
+// both rings hold the last capacity records after ADDS adds, so every lookup must agree
+template <std::uint32_t N>
+bool same_lookups(const std::vector<record> &records, const std::vector<std::size_t> &offsets)
+{
+    aesd_circular_buffer c_buffer;
+    std::vector<aesd_buffer_entry> entries(aesd_circular_buffer_slots_for(N));
+    auto cpp_buffer = std::make_unique<aesd::circular_buffer<std::string_view, N>>();
+
+    aesd_circular_buffer_init_capacity(&c_buffer, entries.data(), entries.size(), N);
+    for (int i = 0; i < ADDS; i++)
+    {
+        aesd_buffer_entry entry;
+        entry.buffptr = records[i & (RECORDS - 1)].data;
+        entry.size = records[i & (RECORDS - 1)].size;
+        aesd_circular_buffer_add_entry(&c_buffer, &entry);
+        cpp_buffer->emplace(entry.buffptr, entry.size);
+    }
+    if (c_buffer.total_size != cpp_buffer->total_size())
+    {
+        return false;
+    }
+    for (std::size_t offset : offsets)
+    {
+        std::size_t c_offset;
+        aesd_buffer_entry *c_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&c_buffer, offset, &c_offset);
+        auto [cpp_entry, cpp_offset] = cpp_buffer->find_fpos(offset);
+        if (c_entry == nullptr || cpp_entry == cpp_buffer->cend() || c_entry->buffptr != cpp_entry->data() ||
+            c_offset != cpp_offset)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <std::uint32_t N>
+void bench_capacity(const std::vector<record> &records)
+{
+    std::vector<std::size_t> offsets(LOOKUPS);
+    std::size_t total_size = 0;
+    // the ring ends up holding the N records before the last add
+    for (int i = ADDS - static_cast<int>(N); i < ADDS; i++)
+    {
+        total_size += records[i & (RECORDS - 1)].size;
+    }
+    for (std::size_t &offset : offsets)
+    {
+        offset = ((std::size_t)next_random() << 16 ^ next_random()) % total_size;
+    }
+    if (!same_lookups<N>(records, offsets))
+    {
+        std::fprintf(stderr, "%u entries: C and C++ lookups differ\n", N);
+        std::exit(EXIT_FAILURE);
+    }
+    results c = bench_c(N, records, offsets);
+    results cpp = bench_cpp<N>(records, offsets);
+    std::printf("%8u %10.1f %10.1f %10.2f %10.2f %10.1f %10.1f\n", N, c.add_ns, cpp.add_ns, c.walk_ns, cpp.walk_ns,
+                c.lookup_ns, cpp.lookup_ns);
+}
+
+} // namespace
+
+int main()
+{
+    static char bytes[512];
+    std::vector<record> records(RECORDS);
+    std::memset(bytes, 'x', sizeof(bytes));
+    for (record &r : records)
+    {
+        r.size = 1 + next_random() % 200;
+        r.data = bytes + next_random() % 256;
+    }
+    std::printf("%8s %10s %10s %10s %10s %10s %10s\n", "entries", "C add", "C++ add", "C walk", "C++ walk",
+                "C lookup", "C++ lookup");
+    std::printf("%8s %10s %10s %10s %10s %10s %10s\n", "", "ns/op", "ns/op", "ns/entry", "ns/entry", "ns/op",
+                "ns/op");
+    bench_capacity<10>(records);
+    bench_capacity<16>(records);
+    bench_capacity<1000>(records);
+    bench_capacity<1024>(records);
+    bench_capacity<100000>(records);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+/**
+ * @file bench-circular-buffer.c
+ * @brief Lookup cost of aesd_circular_buffer_find_entry_offset_for_fpos() by buffer capacity
+ *
+ * Fills buffers of 10 up to 1M entries with records of varying length, wrapped around so the
+ * oldest entry sits in the middle of the slot array, and times random fpos lookups. The linear
+ * walk the lookup used before the prefix sum index is timed alongside as the reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define LOOKUPS 200000
+#define LINEAR_BUDGET_NS 2000000000ULL
+
+static unsigned int seed = 1;
+// lookups feed this so the compiler can't drop them
+static volatile size_t checksum;
+
+static unsigned int next_random(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the lookup before entries carried stream offsets, kept as the reference
+static struct aesd_buffer_entry *find_linear(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                             size_t *entry_offset_byte_rtn)
+{
+    uint32_t index;
+    for (index = buffer->out_offs; index != buffer->in_offs; index++)
+    {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_slot(buffer, index);
+        if (char_offset < entry->size)
+        {
+            *entry_offset_byte_rtn = char_offset;
+            return entry;
+        }
+        char_offset -= entry->size;
+    }
+    return NULL;
+}
+
+static double time_lookups(struct aesd_circular_buffer *buffer, const size_t *offsets, int lookups, int linear)
+{
+    unsigned long long start = now_ns();
+    int i;
+    for (i = 0; i < lookups; i++)
+    {
+        size_t entry_offset;
+        struct aesd_buffer_entry *entry = linear ?
+                                          find_linear(buffer, offsets[i], &entry_offset) :
+                                          aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offsets[i],
+                                                                                          &entry_offset);
+        if (entry == NULL)
+        {
+            fprintf(stderr, "lookup of %zu failed\n", offsets[i]);
+            exit(EXIT_FAILURE);
+        }
+        checksum += entry_offset + entry->buffptr[entry_offset];
+    }
+    return (double)(now_ns() - start) / lookups;
+}
+
+static void bench_capacity(uint32_t capacity, const char *records)
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t slots = aesd_circular_buffer_slots_for(capacity);
+    struct aesd_buffer_entry *entries = calloc(slots, sizeof(struct aesd_buffer_entry));
+    size_t *offsets = malloc(LOOKUPS * sizeof(size_t));
+    uint32_t i;
+    int linear_lookups;
+    double binary_ns;
+    double linear_ns;
+
+    if (entries == NULL || offsets == NULL ||
+        aesd_circular_buffer_init_capacity(&buffer, entries, slots, capacity) != 0)
+    {
+        fprintf(stderr, "setup for %u entries failed\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    // one and a half rounds, so the entries wrap around the end of the slot array
+    for (i = 0; i < capacity + capacity / 2; i++)
+    {
+        struct aesd_buffer_entry entry;
+        entry.size = 1 + next_random() % 200;
+        entry.buffptr = records + next_random() % 256;
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    for (i = 0; i < LOOKUPS; i++)
+    {
+        offsets[i] = ((size_t)next_random() << 16 ^ next_random()) % buffer.total_size;
+    }
+
+    binary_ns = time_lookups(&buffer, offsets, LOOKUPS, 0);
+    // keep the linear walk of the large buffers within a couple of seconds
+    linear_lookups = LINEAR_BUDGET_NS / (capacity * 2 + 100);
+    if (linear_lookups > LOOKUPS)
+    {
+        linear_lookups = LOOKUPS;
+    }
+    linear_ns = time_lookups(&buffer, offsets, linear_lookups, 1);
+    printf("%10u %14zu %14.1f %14.1f %9.1fx\n", capacity, buffer.total_size, binary_ns, linear_ns,
+           linear_ns / binary_ns);
+    free(offsets);
+    free(entries);
+}
+
+int main(void)
+{
+    static const uint32_t capacities[] = {10, 100, 1000, 10000, 100000, 1000000};
+    char *records = malloc(512);
+    size_t i;
+    if (records == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    memset(records, 'x', 512);
+    printf("%10s %14s %14s %14s %10s\n", "entries", "bytes", "binary ns/op", "linear ns/op", "speedup");
+    for (i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++)
+    {
+        bench_capacity(capacities[i], records);
+    }
+    free(records);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,389 @@
+/**
+ * @file bench-driver.c
+ * @brief Multithreaded benchmark of the aesdchar driver built against the userspace kernel shim
+ *
+ * aesd-char-driver/main.c is compiled unchanged against kshim/, so the whole write, read and
+ * ioctl paths run in this process without loading a module. Writer threads write commands of a
+ * fixed size, reader threads read their device from start to end over and over, and ioctl threads
+ * alternate AESDCHAR_IOCGSTATS and AESDCHAR_IOCGENTRIES. Thread n uses device n modulo
+ * aesd_nr_devs. Every call is timed, and the report gives ops/sec and latency percentiles per kind
+ * of operation. Module parameters are given as name=value arguments like insmod takes them.
+ */
+
+#include <getopt.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "kshim.h"
+#include "aesd_ioctl.h"
+
+#define MAX_THREADS 64
+#define READ_CHUNK 4096
+#define MAX_ENTRIES 1024
+
+enum op_kind
+{
+    OP_WRITE,
+    OP_READ,
+    OP_IOCTL,
+    OP_KINDS
+};
+
+static const char *op_names[] = {
+    [OP_WRITE] = "write",
+    [OP_READ] = "read",
+    [OP_IOCTL] = "ioctl",
+};
+
+/*
+ * Latencies in nanoseconds are bucketed with 8 buckets per power of two, so percentiles are
+ * reported within 12.5% of the measured value
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct histogram
+{
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t bytes;
+};
+
+static size_t hist_bucket(uint64_t ns)
+{
+    unsigned int shift;
+    if (ns < HIST_SUB)
+    {
+        return ns;
+    }
+    shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((ns >> shift) & (HIST_SUB - 1));
+}
+
+// the largest latency which falls into bucket
+static uint64_t hist_bucket_max(size_t bucket)
+{
+    size_t group = bucket / HIST_SUB;
+    size_t sub = bucket % HIST_SUB;
+    if (group == 0)
+    {
+        return sub;
+    }
+    return ((uint64_t)(HIST_SUB + sub + 1) << (group - 1)) - 1;
+}
+
+static void hist_record(struct histogram *hist, uint64_t ns, size_t bytes)
+{
+    hist->buckets[hist_bucket(ns)]++;
+    hist->count++;
+    hist->sum_ns += ns;
+    hist->bytes += bytes;
+    if (ns > hist->max_ns)
+    {
+        hist->max_ns = ns;
+    }
+}
+
+static void hist_merge(struct histogram *into, const struct histogram *from)
+{
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum_ns += from->sum_ns;
+    into->bytes += from->bytes;
+    if (from->max_ns > into->max_ns)
+    {
+        into->max_ns = from->max_ns;
+    }
+}
+
+static uint64_t hist_percentile(const struct histogram *hist, double percentile)
+{
+    uint64_t rank = (uint64_t)(hist->count * percentile / 100.0);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen > rank)
+        {
+            return hist_bucket_max(i) < hist->max_ns ? hist_bucket_max(i) : hist->max_ns;
+        }
+    }
+    return hist->max_ns;
+}
+
+struct worker
+{
+    enum op_kind kind;
+    unsigned int minor;
+    size_t command_size;
+    pthread_t thread;
+    struct histogram hist;
+    // calls which returned an error, left out of hist
+    uint64_t errors;
+};
+
+static atomic_bool stop;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int open_device(unsigned int minor, struct inode *inode, struct file *filp)
+{
+    memset(inode, 0, sizeof(*inode));
+    memset(filp, 0, sizeof(*filp));
+    inode->i_cdev = kshim_cdevs[minor];
+    inode->i_rdev = kshim_cdevs[minor]->dev;
+    return kshim_cdevs[minor]->ops->open(inode, filp);
+}
+
+// read or write through the iov_iter entry points, as the VFS does for read(2) and write(2)
+static ssize_t device_rw(const struct file_operations *fops, struct file *filp, void *buf,
+                         size_t count, bool write)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = count };
+    struct iov_iter iter;
+    struct kiocb iocb = { .ki_filp = filp, .ki_pos = filp->f_pos };
+    ssize_t ret;
+
+    kshim_iov_iter_init(&iter, &iov, 1);
+    ret = write ? fops->write_iter(&iocb, &iter) : fops->read_iter(&iocb, &iter);
+    filp->f_pos = iocb.ki_pos;
+    return ret;
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *worker = arg;
+    const struct file_operations *fops = kshim_cdevs[worker->minor]->ops;
+    struct aesd_entry_info *entries = NULL;
+    struct inode inode;
+    struct file filp;
+    char *buf;
+    uint64_t ops = 0;
+
+    buf = malloc(worker->command_size > READ_CHUNK ? worker->command_size : READ_CHUNK);
+    if (worker->kind == OP_IOCTL)
+    {
+        entries = calloc(MAX_ENTRIES, sizeof(*entries));
+    }
+    if (buf == NULL || (worker->kind == OP_IOCTL && entries == NULL) ||
+        open_device(worker->minor, &inode, &filp) != 0)
+    {
+        fprintf(stderr, "%s thread setup failed\n", op_names[worker->kind]);
+        worker->errors++;
+        pthread_barrier_wait(&start_barrier);
+        goto out;
+    }
+    memset(buf, 'a' + worker->minor % 26, worker->command_size);
+    buf[worker->command_size - 1] = '\n';
+    pthread_barrier_wait(&start_barrier);
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed))
+    {
+        uint64_t start = now_ns();
+        ssize_t ret = 0;
+        long ioctl_ret;
+
+        switch (worker->kind)
+        {
+        case OP_WRITE:
+            ret = device_rw(fops, &filp, buf, worker->command_size, true);
+            break;
+        case OP_READ:
+            ret = device_rw(fops, &filp, buf, READ_CHUNK, false);
+            if (ret == 0)
+            {
+                fops->llseek(&filp, 0, SEEK_SET);
+            }
+            break;
+        case OP_IOCTL:
+            if (ops & 1)
+            {
+                struct aesd_entries request = {
+                    .entries = (uintptr_t)entries,
+                    .max_entries = MAX_ENTRIES,
+                };
+                ioctl_ret = fops->unlocked_ioctl(&filp, AESDCHAR_IOCGENTRIES, (unsigned long)&request);
+            }
+            else
+            {
+                struct aesd_stats stats;
+                ioctl_ret = fops->unlocked_ioctl(&filp, AESDCHAR_IOCGSTATS, (unsigned long)&stats);
+            }
+            ret = ioctl_ret < 0 ? ioctl_ret : 0;
+            break;
+        default:
+            break;
+        }
+        if (ret < 0)
+        {
+            worker->errors++;
+            continue;
+        }
+        hist_record(&worker->hist, now_ns() - start, ret);
+        ops++;
+    }
+    fops->release(&inode, &filp);
+out:
+    free(entries);
+    free(buf);
+    return NULL;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [-t seconds] [-w writers] [-r readers] [-i ioctl threads] [-s command bytes]\n"
+            "       [-c] [module parameter=value ...]\n"
+            "  -c prints the debugfs counters of every device afterwards\n"
+            "module parameters and their defaults:\n",
+            program);
+    kshim_print_params(stderr);
+}
+
+int main(int argc, char **argv)
+{
+    static struct worker workers[MAX_THREADS];
+    unsigned int threads[OP_KINDS] = { [OP_WRITE] = 2, [OP_READ] = 2, [OP_IOCTL] = 1 };
+    unsigned int seconds = 2;
+    size_t command_size = 64;
+    bool counters = false;
+    unsigned int devices = 0;
+    size_t nworkers = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:w:r:i:s:ch")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            threads[OP_WRITE] = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            threads[OP_READ] = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            threads[OP_IOCTL] = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            command_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            counters = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        if (kshim_set_param(argv[i]) != 0)
+        {
+            fprintf(stderr, "bad module parameter %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (command_size == 0 || seconds == 0 ||
+        threads[OP_WRITE] + threads[OP_READ] + threads[OP_IOCTL] > MAX_THREADS)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (kshim_module_init() != 0)
+    {
+        fprintf(stderr, "aesdchar init failed\n");
+        return 1;
+    }
+    while (devices < KSHIM_MAX_CDEVS && kshim_cdevs[devices] != NULL)
+    {
+        devices++;
+    }
+
+    for (enum op_kind kind = 0; kind < OP_KINDS; kind++)
+    {
+        for (unsigned int i = 0; i < threads[kind]; i++, nworkers++)
+        {
+            workers[nworkers].kind = kind;
+            workers[nworkers].minor = i % devices;
+            workers[nworkers].command_size = command_size;
+        }
+    }
+    pthread_barrier_init(&start_barrier, NULL, nworkers + 1);
+    for (size_t i = 0; i < nworkers; i++)
+    {
+        pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    sleep(seconds);
+    atomic_store(&stop, true);
+    for (size_t i = 0; i < nworkers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+
+    printf("%u devices, %zu byte commands, %.2f s\n", devices, command_size, elapsed);
+    printf("%6s %8s %12s %12s %10s %9s %9s %9s %9s %10s\n", "op", "threads", "ops", "ops/s",
+           "MB/s", "mean ns", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    for (enum op_kind kind = 0; kind < OP_KINDS; kind++)
+    {
+        struct histogram total;
+        uint64_t errors = 0;
+        if (threads[kind] == 0)
+        {
+            continue;
+        }
+        memset(&total, 0, sizeof(total));
+        for (size_t i = 0; i < nworkers; i++)
+        {
+            if (workers[i].kind == kind)
+            {
+                hist_merge(&total, &workers[i].hist);
+                errors += workers[i].errors;
+            }
+        }
+        printf("%6s %8u %12llu %12.0f %10.1f %9.0f %9llu %9llu %9llu %10llu\n", op_names[kind],
+               threads[kind], (unsigned long long)total.count, total.count / elapsed,
+               total.bytes / elapsed / 1e6, total.count ? (double)total.sum_ns / total.count : 0.0,
+               (unsigned long long)hist_percentile(&total, 50.0),
+               (unsigned long long)hist_percentile(&total, 99.0),
+               (unsigned long long)hist_percentile(&total, 99.9),
+               (unsigned long long)total.max_ns);
+        if (errors)
+        {
+            printf("%6s errors %llu\n", op_names[kind], (unsigned long long)errors);
+        }
+    }
+
+    if (counters)
+    {
+        for (unsigned int minor = 0; minor < devices; minor++)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "aesdchar%u", minor);
+            printf("%s:\n", name);
+            kshim_debugfs_show(name, stdout);
+        }
+    }
+    kshim_module_exit();
+    return 0;
+}
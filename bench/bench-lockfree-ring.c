@@ -0,0 +1,198 @@
+/**
+ * @file bench-lockfree-ring.c
+ * @brief Throughput of the lock free rings against a mutex protected aesd_circular_buffer
+ *
+ * Producer threads push ENTRIES entries each, one consumer pops them all and checks every
+ * producer's entries arrive in order. The baseline queue is an aesd_circular_buffer behind a
+ * pthread mutex, with producers waiting instead of overwriting while it is full, which is what an
+ * in-process pipeline has to do today.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-circular-buffer-lockfree.h"
+
+#define ENTRIES 2000000
+#define SLOTS 1024
+#define MAX_PRODUCERS 8
+
+enum queue_kind
+{
+    QUEUE_MUTEX,
+    QUEUE_SPSC,
+    QUEUE_MPSC,
+};
+
+static const char *queue_names[] = {
+    [QUEUE_MUTEX] = "mutex",
+    [QUEUE_SPSC] = "spsc",
+    [QUEUE_MPSC] = "mpsc",
+};
+
+struct queue
+{
+    enum queue_kind kind;
+    pthread_mutex_t mutex;
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[SLOTS];
+    struct aesd_spsc_ring spsc;
+    struct aesd_mpsc_ring mpsc;
+    struct aesd_mpsc_slot slots[SLOTS];
+};
+
+// entries carry a pointer into this array naming their producer, and their sequence number as size
+static const char producer_tags[MAX_PRODUCERS];
+
+struct producer
+{
+    struct queue *queue;
+    size_t id;
+    pthread_t thread;
+};
+
+static bool queue_push(struct queue *queue, const struct aesd_buffer_entry *entry)
+{
+    bool pushed = false;
+    switch (queue->kind)
+    {
+    case QUEUE_MUTEX:
+        pthread_mutex_lock(&queue->mutex);
+        if (!queue->buffer.full)
+        {
+            aesd_circular_buffer_add_entry(&queue->buffer, entry);
+            pushed = true;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+        return pushed;
+    case QUEUE_SPSC:
+        return aesd_spsc_ring_push(&queue->spsc, entry);
+    case QUEUE_MPSC:
+        return aesd_mpsc_ring_push(&queue->mpsc, entry);
+    }
+    return false;
+}
+
+static bool queue_pop(struct queue *queue, struct aesd_buffer_entry *entry)
+{
+    bool popped = false;
+    const char *evicted;
+    switch (queue->kind)
+    {
+    case QUEUE_MUTEX:
+        pthread_mutex_lock(&queue->mutex);
+        if (aesd_circular_buffer_count(&queue->buffer) != 0)
+        {
+            *entry = *aesd_circular_buffer_slot(&queue->buffer, queue->buffer.out_offs);
+            // a budget below any entry size makes evict_for drop the oldest entry
+            aesd_circular_buffer_evict_for(&queue->buffer, (size_t)-1, &evicted);
+            popped = true;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+        return popped;
+    case QUEUE_SPSC:
+        return aesd_spsc_ring_pop(&queue->spsc, entry);
+    case QUEUE_MPSC:
+        return aesd_mpsc_ring_pop(&queue->mpsc, entry);
+    }
+    return false;
+}
+
+static void *producer_main(void *arg)
+{
+    struct producer *producer = arg;
+    struct aesd_buffer_entry entry;
+    size_t sequence;
+    entry.buffptr = &producer_tags[producer->id];
+    for (sequence = 0; sequence < ENTRIES; sequence++)
+    {
+        entry.size = sequence;
+        while (!queue_push(producer->queue, &entry))
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static double run(enum queue_kind kind, size_t producers)
+{
+    struct queue *queue = calloc(1, sizeof(struct queue));
+    struct producer producer[MAX_PRODUCERS];
+    size_t expected[MAX_PRODUCERS] = {0};
+    struct aesd_buffer_entry entry;
+    size_t id;
+    struct timespec start;
+    struct timespec end;
+    size_t popped = 0;
+    size_t i;
+
+    if (queue == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    queue->kind = kind;
+    pthread_mutex_init(&queue->mutex, NULL);
+    aesd_circular_buffer_init_capacity(&queue->buffer, queue->entries, SLOTS, SLOTS);
+    queue->buffer.byte_budget = 1;
+    aesd_spsc_ring_init(&queue->spsc, queue->entries, SLOTS);
+    aesd_mpsc_ring_init(&queue->mpsc, queue->slots, SLOTS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < producers; i++)
+    {
+        producer[i].queue = queue;
+        producer[i].id = i;
+        pthread_create(&producer[i].thread, NULL, producer_main, &producer[i]);
+    }
+    while (popped < producers * ENTRIES)
+    {
+        if (!queue_pop(queue, &entry))
+        {
+            sched_yield();
+            continue;
+        }
+        id = entry.buffptr - producer_tags;
+        if (id >= producers || entry.size != expected[id]++)
+        {
+            fprintf(stderr, "%s: producer %zu entry %zu out of order\n", queue_names[kind], id, entry.size);
+            exit(EXIT_FAILURE);
+        }
+        popped++;
+    }
+    for (i = 0; i < producers; i++)
+    {
+        pthread_join(producer[i].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue);
+    return popped / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9) / 1e6;
+}
+
+int main(void)
+{
+    static const size_t producer_counts[] = {1, 2, 4, 8};
+    size_t i;
+    printf("%10s %8s %14s %14s %14s\n", "producers", "slots", "mutex Mops/s", "spsc Mops/s", "mpsc Mops/s");
+    for (i = 0; i < sizeof(producer_counts) / sizeof(producer_counts[0]); i++)
+    {
+        size_t producers = producer_counts[i];
+        double mutex = run(QUEUE_MUTEX, producers);
+        double mpsc = run(QUEUE_MPSC, producers);
+        if (producers == 1)
+        {
+            printf("%10zu %8d %14.2f %14.2f %14.2f\n", producers, SLOTS, mutex, run(QUEUE_SPSC, producers), mpsc);
+        }
+        else
+        {
+            printf("%10zu %8d %14.2f %14s %14.2f\n", producers, SLOTS, mutex, "-", mpsc);
+        }
+    }
+    return EXIT_SUCCESS;
+}
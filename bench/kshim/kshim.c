@@ -0,0 +1,289 @@
+/**
+ * @file kshim.c
+ * @brief Userspace stand-ins for the kernel services kshim.h only declares
+ */
+
+#include "kshim.h"
+
+struct cdev *kshim_cdevs[KSHIM_MAX_CDEVS];
+
+// module parameters, registered by constructors module_param() emits
+
+#define KSHIM_MAX_PARAMS 32
+
+struct kshim_param
+{
+    const char *name;
+    void *value;
+    enum kshim_param_type type;
+};
+
+static struct kshim_param kshim_params[KSHIM_MAX_PARAMS];
+static size_t kshim_param_count;
+
+void kshim_register_param(const char *name, void *value, enum kshim_param_type type)
+{
+    if (kshim_param_count < KSHIM_MAX_PARAMS)
+    {
+        kshim_params[kshim_param_count].name = name;
+        kshim_params[kshim_param_count].value = value;
+        kshim_params[kshim_param_count].type = type;
+        kshim_param_count++;
+    }
+}
+
+int kshim_set_param(const char *assignment)
+{
+    const char *equals = strchr(assignment, '=');
+    size_t name_len;
+    unsigned long long value;
+    char *end;
+
+    if (equals == NULL)
+    {
+        return -EINVAL;
+    }
+    name_len = equals - assignment;
+    for (size_t i = 0; i < kshim_param_count; i++)
+    {
+        struct kshim_param *param = &kshim_params[i];
+        if (strlen(param->name) != name_len || strncmp(param->name, assignment, name_len) != 0)
+        {
+            continue;
+        }
+        if (param->type == KSHIM_PARAM_bool)
+        {
+            const char *text = equals + 1;
+            if (strcmp(text, "1") == 0 || strcmp(text, "y") == 0 || strcmp(text, "Y") == 0)
+            {
+                *(bool *)param->value = true;
+            }
+            else if (strcmp(text, "0") == 0 || strcmp(text, "n") == 0 || strcmp(text, "N") == 0)
+            {
+                *(bool *)param->value = false;
+            }
+            else
+            {
+                return -EINVAL;
+            }
+            return 0;
+        }
+        errno = 0;
+        value = strtoull(equals + 1, &end, 0);
+        if (errno != 0 || end == equals + 1 || *end != '\0')
+        {
+            return -EINVAL;
+        }
+        if (param->type == KSHIM_PARAM_uint)
+        {
+            if (value > UINT32_MAX)
+            {
+                return -EINVAL;
+            }
+            *(unsigned int *)param->value = value;
+        }
+        else
+        {
+            *(unsigned long *)param->value = value;
+        }
+        return 0;
+    }
+    return -EINVAL;
+}
+
+void kshim_print_params(FILE *stream)
+{
+    for (size_t i = 0; i < kshim_param_count; i++)
+    {
+        struct kshim_param *param = &kshim_params[i];
+        switch (param->type)
+        {
+        case KSHIM_PARAM_uint:
+            fprintf(stream, "%s=%u\n", param->name, *(unsigned int *)param->value);
+            break;
+        case KSHIM_PARAM_ulong:
+            fprintf(stream, "%s=%lu\n", param->name, *(unsigned long *)param->value);
+            break;
+        case KSHIM_PARAM_bool:
+            fprintf(stream, "%s=%c\n", param->name, *(bool *)param->value ? 'Y' : 'N');
+            break;
+        }
+    }
+}
+
+/*
+ * RCU. Readers count themselves in one of two reader counts, picked by the low bit of the epoch.
+ * A grace period flips the epoch and waits for the count of the old epoch to drain, twice, so
+ * that a reader which loaded the epoch just before a flip and counted itself late is waited for
+ * too (the same scheme SRCU uses). call_rcu() only queues the callback, a reclaimer thread runs
+ * the grace periods: writers call call_rcu() inside their seqcount write section, where waiting
+ * for readers spinning on that seqcount would deadlock.
+ */
+
+static _Atomic long kshim_rcu_readers[2];
+static _Atomic unsigned int kshim_rcu_epoch;
+static _Thread_local unsigned int kshim_rcu_reader_epoch;
+
+static pthread_mutex_t kshim_rcu_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kshim_rcu_queue_cond = PTHREAD_COND_INITIALIZER;
+static struct rcu_head *kshim_rcu_queue;
+// held while a batch of callbacks goes through its grace period, so rcu_barrier() can wait for it
+static pthread_mutex_t kshim_rcu_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t kshim_rcu_once = PTHREAD_ONCE_INIT;
+
+void rcu_read_lock(void)
+{
+    unsigned int epoch;
+    for (;;)
+    {
+        epoch = atomic_load(&kshim_rcu_epoch) & 1;
+        atomic_fetch_add(&kshim_rcu_readers[epoch], 1);
+        if ((atomic_load(&kshim_rcu_epoch) & 1) == epoch)
+        {
+            break;
+        }
+        atomic_fetch_sub(&kshim_rcu_readers[epoch], 1);
+    }
+    kshim_rcu_reader_epoch = epoch;
+}
+
+void rcu_read_unlock(void)
+{
+    atomic_fetch_sub_explicit(&kshim_rcu_readers[kshim_rcu_reader_epoch], 1, memory_order_release);
+}
+
+static void kshim_synchronize_rcu(void)
+{
+    for (int flip = 0; flip < 2; flip++)
+    {
+        unsigned int old = atomic_fetch_add(&kshim_rcu_epoch, 1) & 1;
+        while (atomic_load(&kshim_rcu_readers[old]) != 0)
+        {
+            sched_yield();
+        }
+    }
+}
+
+// runs the callbacks queued so far after a grace period, with kshim_rcu_reclaim_lock held
+static void kshim_rcu_reclaim(void)
+{
+    struct rcu_head *list;
+
+    pthread_mutex_lock(&kshim_rcu_queue_lock);
+    list = kshim_rcu_queue;
+    kshim_rcu_queue = NULL;
+    pthread_mutex_unlock(&kshim_rcu_queue_lock);
+    if (list == NULL)
+    {
+        return;
+    }
+    kshim_synchronize_rcu();
+    while (list != NULL)
+    {
+        struct rcu_head *next = list->next;
+        list->func(list);
+        list = next;
+    }
+}
+
+static void *kshim_rcu_reclaimer(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&kshim_rcu_queue_lock);
+        while (kshim_rcu_queue == NULL)
+        {
+            pthread_cond_wait(&kshim_rcu_queue_cond, &kshim_rcu_queue_lock);
+        }
+        pthread_mutex_unlock(&kshim_rcu_queue_lock);
+        pthread_mutex_lock(&kshim_rcu_reclaim_lock);
+        kshim_rcu_reclaim();
+        pthread_mutex_unlock(&kshim_rcu_reclaim_lock);
+    }
+    return NULL;
+}
+
+static void kshim_rcu_start(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, kshim_rcu_reclaimer, NULL) == 0)
+    {
+        pthread_detach(thread);
+    }
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    pthread_once(&kshim_rcu_once, kshim_rcu_start);
+    head->func = func;
+    pthread_mutex_lock(&kshim_rcu_queue_lock);
+    head->next = kshim_rcu_queue;
+    kshim_rcu_queue = head;
+    pthread_cond_signal(&kshim_rcu_queue_cond);
+    pthread_mutex_unlock(&kshim_rcu_queue_lock);
+}
+
+void rcu_barrier(void)
+{
+    pthread_mutex_lock(&kshim_rcu_reclaim_lock);
+    kshim_rcu_reclaim();
+    pthread_mutex_unlock(&kshim_rcu_reclaim_lock);
+}
+
+// debugfs
+
+struct kshim_debugfs_file
+{
+    char *name;
+    void *data;
+    const struct file_operations *fops;
+};
+
+static struct kshim_debugfs_file kshim_debugfs[KSHIM_MAX_DEBUGFS];
+static size_t kshim_debugfs_count;
+static struct dentry kshim_debugfs_dir;
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+    (void)name;
+    (void)parent;
+    return &kshim_debugfs_dir;
+}
+
+struct dentry *debugfs_create_file(const char *name, int mode, struct dentry *parent, void *data,
+                                   const struct file_operations *fops)
+{
+    (void)mode;
+    (void)parent;
+    if (kshim_debugfs_count < KSHIM_MAX_DEBUGFS)
+    {
+        kshim_debugfs[kshim_debugfs_count].name = strdup(name);
+        kshim_debugfs[kshim_debugfs_count].data = data;
+        kshim_debugfs[kshim_debugfs_count].fops = fops;
+        kshim_debugfs_count++;
+    }
+    return NULL;
+}
+
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+    (void)dentry;
+    while (kshim_debugfs_count > 0)
+    {
+        free(kshim_debugfs[--kshim_debugfs_count].name);
+    }
+}
+
+int kshim_debugfs_show(const char *name, FILE *stream)
+{
+    for (size_t i = 0; i < kshim_debugfs_count; i++)
+    {
+        if (strcmp(kshim_debugfs[i].name, name) == 0)
+        {
+            struct seq_file seq = { .private = kshim_debugfs[i].data, .stream = stream };
+            return kshim_debugfs[i].fops->kshim_show(&seq, NULL);
+        }
+    }
+    return -ENOENT;
+}
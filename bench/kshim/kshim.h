@@ -0,0 +1,717 @@
+/**
+ * @file kshim.h
+ * @brief Userspace stand-ins for the kernel interfaces the aesdchar driver uses
+ *
+ * Building aesd-char-driver/main.c with -D__KERNEL__ -Ikshim makes every linux/ header it includes
+ * resolve to this file, so the driver runs unchanged inside a normal process. The stand-ins keep
+ * the semantics the driver relies on (mutexes, seqcounts, RCU grace periods, wait queues, iov_iter)
+ * and nothing more. After kshim_module_init() the registered char devices are in kshim_cdevs,
+ * indexed by minor, and files are opened through their file_operations.
+ */
+
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+// types
+
+#define loff_t long long
+#define dev_t kshim_dev_t
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+// the kernel's u64 is unsigned long long everywhere, which printk formats rely on
+typedef unsigned long long u64;
+typedef long long s64;
+typedef unsigned int dev_t;
+typedef unsigned int __poll_t;
+
+#define __user
+#define __percpu
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+
+#define LINUX_VERSION_CODE 0x060800
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+
+#define PAGE_SIZE 4096
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1))
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b) ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *)&(x) = (val))
+#define smp_wmb() atomic_thread_fence(memory_order_release)
+#define u64_to_user_ptr(x) ((void *)(uintptr_t)(x))
+
+#define ERESTARTSYS 512
+
+// module glue
+
+struct module;
+#define THIS_MODULE NULL
+#define MODULE_AUTHOR(x)
+#define MODULE_LICENSE(x)
+#define MODULE_PARM_DESC(name, desc)
+#define S_IRUGO 0444
+
+enum kshim_param_type
+{
+    KSHIM_PARAM_uint,
+    KSHIM_PARAM_ulong,
+    KSHIM_PARAM_bool,
+};
+
+void kshim_register_param(const char *name, void *value, enum kshim_param_type type);
+/**
+ * Sets a module parameter from a "name=value" string, as insmod takes them. Only meaningful
+ * before kshim_module_init().
+ * @return 0 on success, -EINVAL for an unknown name or malformed value
+ */
+int kshim_set_param(const char *assignment);
+/**
+ * Prints every module parameter and its current value to stream
+ */
+void kshim_print_params(FILE *stream);
+
+#define module_param(name, type, perm)                                      \
+    static void __attribute__((constructor)) kshim_param_##name(void)      \
+    {                                                                       \
+        kshim_register_param(#name, &name, KSHIM_PARAM_##type);             \
+    }
+
+#define module_init(fn) int kshim_module_init(void) { return fn(); }
+#define module_exit(fn) void kshim_module_exit(void) { fn(); }
+int kshim_module_init(void);
+void kshim_module_exit(void);
+
+// printk
+
+#define KERN_DEBUG ""
+#define KERN_INFO ""
+#define KERN_WARNING ""
+#define KERN_ERR ""
+#define printk(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+
+// memory
+
+#define GFP_KERNEL 0
+
+static inline void *kmalloc(size_t size, int flags)
+{
+    (void)flags;
+    return malloc(size ? size : 1);
+}
+
+static inline void *kzalloc(size_t size, int flags)
+{
+    (void)flags;
+    return calloc(1, size ? size : 1);
+}
+
+static inline void *kcalloc(size_t n, size_t size, int flags)
+{
+    (void)flags;
+    return calloc(n ? n : 1, size ? size : 1);
+}
+
+static inline void *krealloc(const void *ptr, size_t size, int flags)
+{
+    (void)flags;
+    return realloc((void *)ptr, size ? size : 1);
+}
+
+static inline void kfree(const void *ptr)
+{
+    free((void *)ptr);
+}
+
+static inline void *kvmalloc(size_t size, int flags)
+{
+    (void)flags;
+    return malloc(size ? size : 1);
+}
+
+static inline void *kvcalloc(size_t n, size_t size, int flags)
+{
+    (void)flags;
+    return calloc(n ? n : 1, size ? size : 1);
+}
+
+static inline void *kvmalloc_array(size_t n, size_t size, int flags)
+{
+    (void)flags;
+    return malloc(n && size ? n * size : 1);
+}
+
+static inline void kvfree(const void *ptr)
+{
+    free((void *)ptr);
+}
+
+static inline void *vmalloc_user(size_t size)
+{
+    void *ptr = aligned_alloc(PAGE_SIZE, PAGE_ALIGN(size));
+    if (ptr)
+    {
+        memset(ptr, 0, PAGE_ALIGN(size));
+    }
+    return ptr;
+}
+
+static inline void vfree(const void *ptr)
+{
+    free((void *)ptr);
+}
+
+struct kmem_cache
+{
+    size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                                   unsigned long flags, void (*ctor)(void *))
+{
+    struct kmem_cache *cache = malloc(sizeof(*cache));
+    (void)name;
+    (void)align;
+    (void)flags;
+    (void)ctor;
+    if (cache)
+    {
+        cache->size = size;
+    }
+    return cache;
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache *cache)
+{
+    free(cache);
+}
+
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, int flags)
+{
+    (void)flags;
+    return malloc(cache->size);
+}
+
+static inline void kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+    (void)cache;
+    free(ptr);
+}
+
+// the process shares one set of counters, updated atomically since all threads add to it
+
+#define alloc_percpu(type) ((type *)calloc(1, sizeof(type)))
+#define free_percpu(ptr) free(ptr)
+#define this_cpu_add(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define per_cpu_ptr(ptr, cpu) ((void)(cpu), (ptr))
+
+// user copies, user and kernel share the address space
+
+static inline unsigned long copy_to_user(void *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+struct kiocb
+{
+    struct file *ki_filp;
+    loff_t ki_pos;
+    int ki_flags;
+};
+
+struct iov_iter
+{
+    const struct iovec *iov;
+    unsigned long nr_segs;
+    size_t iov_offset;
+    size_t count;
+};
+
+static inline void kshim_iov_iter_init(struct iov_iter *iter, const struct iovec *iov,
+                                       unsigned long nr_segs)
+{
+    iter->iov = iov;
+    iter->nr_segs = nr_segs;
+    iter->iov_offset = 0;
+    iter->count = 0;
+    for (unsigned long i = 0; i < nr_segs; i++)
+    {
+        iter->count += iov[i].iov_len;
+    }
+}
+
+static inline size_t iov_iter_count(const struct iov_iter *iter)
+{
+    return iter->count;
+}
+
+static inline size_t kshim_iter_copy(struct iov_iter *iter, char *buf, size_t n, bool to_iter)
+{
+    size_t done = 0;
+    while (done < n && iter->count > 0)
+    {
+        size_t segment = iter->iov->iov_len - iter->iov_offset;
+        size_t chunk = n - done < segment ? n - done : segment;
+        char *ptr = (char *)iter->iov->iov_base + iter->iov_offset;
+        if (to_iter)
+        {
+            memcpy(ptr, buf + done, chunk);
+        }
+        else
+        {
+            memcpy(buf + done, ptr, chunk);
+        }
+        done += chunk;
+        iter->count -= chunk;
+        iter->iov_offset += chunk;
+        if (iter->iov_offset == iter->iov->iov_len)
+        {
+            iter->iov++;
+            iter->nr_segs--;
+            iter->iov_offset = 0;
+        }
+    }
+    return done;
+}
+
+static inline size_t copy_to_iter(const void *addr, size_t n, struct iov_iter *iter)
+{
+    return kshim_iter_copy(iter, (char *)addr, n, true);
+}
+
+static inline size_t copy_from_iter(void *addr, size_t n, struct iov_iter *iter)
+{
+    return kshim_iter_copy(iter, addr, n, false);
+}
+
+// locking
+
+struct mutex
+{
+    pthread_mutex_t lock;
+};
+
+static inline void mutex_init(struct mutex *mutex)
+{
+    pthread_mutex_init(&mutex->lock, NULL);
+}
+
+static inline void mutex_destroy(struct mutex *mutex)
+{
+    pthread_mutex_destroy(&mutex->lock);
+}
+
+static inline void mutex_lock(struct mutex *mutex)
+{
+    pthread_mutex_lock(&mutex->lock);
+}
+
+static inline int mutex_lock_interruptible(struct mutex *mutex)
+{
+    return pthread_mutex_lock(&mutex->lock);
+}
+
+static inline int mutex_trylock(struct mutex *mutex)
+{
+    return pthread_mutex_trylock(&mutex->lock) == 0;
+}
+
+static inline void mutex_unlock(struct mutex *mutex)
+{
+    pthread_mutex_unlock(&mutex->lock);
+}
+
+typedef struct
+{
+    _Atomic unsigned int sequence;
+    struct mutex *lock;
+} seqcount_mutex_t;
+
+#define seqcount_mutex_init(s, mutex)              \
+    do                                             \
+    {                                              \
+        atomic_init(&(s)->sequence, 0);            \
+        (s)->lock = (mutex);                       \
+    } while (0)
+
+static inline unsigned int read_seqcount_begin(seqcount_mutex_t *s)
+{
+    unsigned int seq;
+    while ((seq = atomic_load_explicit(&s->sequence, memory_order_acquire)) & 1)
+    {
+        sched_yield();
+    }
+    return seq;
+}
+
+static inline int read_seqcount_retry(seqcount_mutex_t *s, unsigned int seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&s->sequence, memory_order_relaxed) != seq;
+}
+
+static inline void write_seqcount_begin(seqcount_mutex_t *s)
+{
+    atomic_store_explicit(&s->sequence, atomic_load_explicit(&s->sequence, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void write_seqcount_end(seqcount_mutex_t *s)
+{
+    atomic_store_explicit(&s->sequence, atomic_load_explicit(&s->sequence, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+typedef struct
+{
+    _Atomic int counter;
+} atomic_t;
+
+static inline void atomic_dec(atomic_t *v)
+{
+    atomic_fetch_sub(&v->counter, 1);
+}
+
+static inline int atomic_inc_return(atomic_t *v)
+{
+    return atomic_fetch_add(&v->counter, 1) + 1;
+}
+
+struct llist_node
+{
+    struct llist_node *next;
+};
+
+struct llist_head
+{
+    struct llist_node *_Atomic first;
+};
+
+static inline bool llist_add(struct llist_node *node, struct llist_head *head)
+{
+    struct llist_node *first = atomic_load(&head->first);
+    do
+    {
+        node->next = first;
+    } while (!atomic_compare_exchange_weak(&head->first, &first, node));
+    return first == NULL;
+}
+
+// the kernel requires llist_del_first callers to be serialized, which also rules out ABA here
+static inline struct llist_node *llist_del_first(struct llist_head *head)
+{
+    struct llist_node *first = atomic_load(&head->first);
+    do
+    {
+        if (!first)
+        {
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak(&head->first, &first, first->next));
+    return first;
+}
+
+static inline struct llist_node *llist_del_all(struct llist_head *head)
+{
+    return atomic_exchange(&head->first, NULL);
+}
+
+#define llist_entry(ptr, type, member) container_of(ptr, type, member)
+#define llist_for_each_entry_safe(pos, n, node, member)                                         \
+    for (pos = (node) ? llist_entry((node), __typeof__(*pos), member) : NULL;                   \
+         pos && (n = pos->member.next ? llist_entry(pos->member.next, __typeof__(*pos), member) \
+                                      : NULL, 1);                                               \
+         pos = n)
+
+// RCU, see kshim.c
+
+struct rcu_head
+{
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_barrier(void);
+
+// wait queues, waiters check their condition under the queue lock so no wakeup is lost
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+}
+
+static inline void wake_up_interruptible(wait_queue_head_t *wq)
+{
+    pthread_mutex_lock(&wq->lock);
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+#define wait_event_interruptible(wq, condition)                 \
+    ({                                                          \
+        pthread_mutex_lock(&(wq).lock);                         \
+        while (!(condition))                                    \
+        {                                                       \
+            pthread_cond_wait(&(wq).cond, &(wq).lock);          \
+        }                                                       \
+        pthread_mutex_unlock(&(wq).lock);                       \
+        0;                                                      \
+    })
+
+struct file;
+typedef struct poll_table_struct
+{
+    int unused;
+} poll_table;
+
+static inline void poll_wait(struct file *filp, wait_queue_head_t *wq, poll_table *table)
+{
+    (void)filp;
+    (void)wq;
+    (void)table;
+}
+
+#define EPOLLIN 0x001
+#define EPOLLOUT 0x004
+#define EPOLLRDNORM 0x040
+#define EPOLLWRNORM 0x100
+
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// files and char devices
+
+struct inode;
+struct pipe_inode_info;
+struct seq_file;
+struct vm_area_struct;
+
+struct file_operations
+{
+    struct module *owner;
+    loff_t (*llseek)(struct file *, loff_t, int);
+    ssize_t (*read_iter)(struct kiocb *, struct iov_iter *);
+    ssize_t (*write_iter)(struct kiocb *, struct iov_iter *);
+    ssize_t (*splice_read)(struct file *, loff_t *, struct pipe_inode_info *, size_t, unsigned int);
+    ssize_t (*splice_write)(struct pipe_inode_info *, struct file *, loff_t *, size_t, unsigned int);
+    long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+    int (*open)(struct inode *, struct file *);
+    int (*release)(struct inode *, struct file *);
+    __poll_t (*poll)(struct file *, struct poll_table_struct *);
+    int (*mmap)(struct file *, struct vm_area_struct *);
+    // the show function behind a DEFINE_SHOW_ATTRIBUTE file
+    int (*kshim_show)(struct seq_file *, void *);
+};
+
+struct cdev
+{
+    struct module *owner;
+    const struct file_operations *ops;
+    dev_t dev;
+};
+
+struct inode
+{
+    struct cdev *i_cdev;
+    dev_t i_rdev;
+};
+
+struct file
+{
+    void *private_data;
+    loff_t f_pos;
+    unsigned int f_flags;
+};
+
+#define MINORBITS 20
+#define MKDEV(major, minor) (((major) << MINORBITS) | (minor))
+#define MAJOR(dev) ((unsigned int)((dev) >> MINORBITS))
+#define MINOR(dev) ((unsigned int)((dev) & ((1U << MINORBITS) - 1)))
+
+#define KSHIM_MAX_CDEVS 64
+/**
+ * Char devices added by the module, indexed by minor
+ */
+extern struct cdev *kshim_cdevs[KSHIM_MAX_CDEVS];
+
+static inline int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count,
+                                      const char *name)
+{
+    (void)count;
+    (void)name;
+    *dev = MKDEV(240, baseminor);
+    return 0;
+}
+
+static inline void unregister_chrdev_region(dev_t dev, unsigned int count)
+{
+    (void)dev;
+    (void)count;
+}
+
+static inline void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+    cdev->ops = fops;
+}
+
+static inline int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count)
+{
+    (void)count;
+    if (MINOR(dev) >= KSHIM_MAX_CDEVS)
+    {
+        return -ENODEV;
+    }
+    cdev->dev = dev;
+    kshim_cdevs[MINOR(dev)] = cdev;
+    return 0;
+}
+
+static inline void cdev_del(struct cdev *cdev)
+{
+    kshim_cdevs[MINOR(cdev->dev)] = NULL;
+}
+
+static inline loff_t fixed_size_llseek(struct file *filp, loff_t off, int whence, loff_t size)
+{
+    loff_t pos;
+    switch (whence)
+    {
+    case SEEK_SET:
+        pos = off;
+        break;
+    case SEEK_CUR:
+        pos = filp->f_pos + off;
+        break;
+    case SEEK_END:
+        pos = size + off;
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (pos < 0 || pos > size)
+    {
+        return -EINVAL;
+    }
+    filp->f_pos = pos;
+    return pos;
+}
+
+// splice needs pipes, which the shim doesn't have
+static inline ssize_t copy_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+                                       size_t len, unsigned int flags)
+{
+    (void)in;
+    (void)ppos;
+    (void)pipe;
+    (void)len;
+    (void)flags;
+    return -EINVAL;
+}
+
+static inline ssize_t iter_file_splice_write(struct pipe_inode_info *pipe, struct file *out,
+                                             loff_t *ppos, size_t len, unsigned int flags)
+{
+    (void)pipe;
+    (void)out;
+    (void)ppos;
+    (void)len;
+    (void)flags;
+    return -EINVAL;
+}
+
+// mmap records the kernel address the vma maps instead of mapping pages
+
+#define VM_WRITE 0x2
+#define VM_MAYWRITE 0x20
+
+struct vm_area_struct
+{
+    unsigned long vm_start;
+    unsigned long vm_end;
+    unsigned long vm_pgoff;
+    unsigned long vm_flags;
+    void *kshim_addr;
+};
+
+static inline void vm_flags_clear(struct vm_area_struct *vma, unsigned long flags)
+{
+    vma->vm_flags &= ~flags;
+}
+
+static inline int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff)
+{
+    vma->kshim_addr = (char *)addr + pgoff * PAGE_SIZE;
+    return 0;
+}
+
+// debugfs files are kept in a table, kshim_debugfs_show() prints one
+
+struct dentry
+{
+    int unused;
+};
+
+struct seq_file
+{
+    void *private;
+    FILE *stream;
+};
+
+#define seq_printf(m, fmt, ...) fprintf((m)->stream, fmt, ##__VA_ARGS__)
+#define DEFINE_SHOW_ATTRIBUTE(__name) \
+    static const struct file_operations __name##_fops = { .kshim_show = __name##_show }
+
+#define KSHIM_MAX_DEBUGFS 64
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, int mode, struct dentry *parent, void *data,
+                                   const struct file_operations *fops);
+void debugfs_remove_recursive(struct dentry *dentry);
+/**
+ * Prints the debugfs file called name to stream
+ * @return 0 on success, -ENOENT when there is no such file
+ */
+int kshim_debugfs_show(const char *name, FILE *stream);
+
+#endif /* KSHIM_H */
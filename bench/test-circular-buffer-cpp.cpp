@@ -0,0 +1,192 @@
+/**
+ * @file test-circular-buffer-cpp.cpp
+ * @brief Checks of aesd::circular_buffer<T, N>
+ *
+ * Covers push, pop and eviction with owning aesd::owned_entry entries, find_fpos() at entry
+ * boundaries and past the end, and iterator arithmetic while the free running indices wrap past
+ * UINT32_MAX. aesd::circular_buffer_test gets there by moving the indices of an empty ring.
+ * Prints one line per failed check and exits non zero if there was any.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <tuple>
+
+#include "aesd-circular-buffer.hpp"
+
+namespace aesd
+{
+
+// friend of circular_buffer, see its private section
+struct circular_buffer_test
+{
+    /**
+     * Moves the free running indices of the empty @param buffer to @param index, as if that many
+     * entries had been added and removed already
+     */
+    template <typename T, std::uint32_t N>
+    static void start_at(circular_buffer<T, N> &buffer, std::uint32_t index)
+    {
+        buffer.in_offs_ = index;
+        buffer.out_offs_ = index;
+    }
+};
+
+} // namespace aesd
+
+namespace
+{
+
+int failures;
+
+#define CHECK(condition)                                                                       \
+    do                                                                                         \
+    {                                                                                          \
+        if (!(condition))                                                                      \
+        {                                                                                      \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                                        \
+        }                                                                                      \
+    } while (0)
+
+bool holds(const aesd::owned_entry &entry, const char *text)
+{
+    return entry.size() == std::strlen(text) && std::memcmp(entry.data(), text, entry.size()) == 0;
+}
+
+void test_owned_entry_push_pop_evict()
+{
+    static const char *const records[] = {"one\n", "two\n", "three\n", "four\n"};
+    aesd::circular_buffer<aesd::owned_entry, 3> buffer;
+
+    CHECK(buffer.empty());
+    CHECK(!buffer.pop().has_value());
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK(!buffer.push(aesd::owned_entry(records[i], std::strlen(records[i]))).has_value());
+    }
+    CHECK(buffer.full());
+    CHECK(buffer.total_size() == 14);
+
+    // the oldest entry comes back to the caller, bytes and all
+    std::optional<aesd::owned_entry> evicted = buffer.emplace(records[3], std::strlen(records[3]));
+    CHECK(evicted.has_value() && holds(*evicted, "one\n"));
+    CHECK(buffer.size() == 3);
+    CHECK(buffer.total_size() == 15);
+    CHECK(buffer.stream_offs() == 19);
+    CHECK(holds(buffer.front(), "two\n"));
+    CHECK(holds(buffer.back(), "four\n"));
+
+    std::optional<aesd::owned_entry> popped = buffer.pop();
+    CHECK(popped.has_value() && holds(*popped, "two\n"));
+    CHECK(buffer.total_size() == 11);
+    CHECK(holds(buffer[0], "three\n"));
+
+    buffer.clear();
+    CHECK(buffer.empty());
+    CHECK(buffer.total_size() == 0);
+    CHECK(buffer.stream_offs() == 19);
+}
+
+void test_find_fpos()
+{
+    aesd::circular_buffer<std::string_view, 3> buffer;
+
+    CHECK(buffer.find_fpos(0).first == buffer.end());
+    buffer.push("ab");
+    buffer.push("cde");
+    buffer.push("f");
+
+    auto [it, offset] = buffer.find_fpos(0);
+    CHECK(it == buffer.begin() && offset == 0);
+    std::tie(it, offset) = buffer.find_fpos(1);
+    CHECK(it == buffer.begin() && offset == 1);
+    // the first byte of an entry belongs to it, not to the end of the previous one
+    std::tie(it, offset) = buffer.find_fpos(2);
+    CHECK(it == buffer.begin() + 1 && offset == 0 && *it == "cde");
+    std::tie(it, offset) = buffer.find_fpos(4);
+    CHECK(it == buffer.begin() + 1 && offset == 2);
+    std::tie(it, offset) = buffer.find_fpos(5);
+    CHECK(it == buffer.begin() + 2 && offset == 0 && *it == "f");
+    CHECK(buffer.find_fpos(6).first == buffer.end());
+    CHECK(buffer.find_fpos(SIZE_MAX).first == buffer.end());
+
+    // offsets count from the oldest entry still stored
+    buffer.push("gh");
+    std::tie(it, offset) = buffer.find_fpos(0);
+    CHECK(it == buffer.begin() && offset == 0 && *it == "cde");
+    std::tie(it, offset) = buffer.find_fpos(3);
+    CHECK(it == buffer.begin() + 1 && offset == 0 && *it == "f");
+    std::tie(it, offset) = buffer.find_fpos(5);
+    CHECK(it == buffer.begin() + 2 && offset == 1 && *it == "gh");
+    CHECK(buffer.find_fpos(6).first == buffer.end());
+    CHECK(buffer.entry_fpos(2) == 4);
+}
+
+void test_iterator_wraparound()
+{
+    static const std::string_view records[] = {"a", "bb", "ccc", "dddd"};
+    aesd::circular_buffer<std::string_view, 4> buffer;
+
+    // the two oldest entries get indices just below UINT32_MAX, the two newest wrap past 0
+    aesd::circular_buffer_test::start_at(buffer, UINT32_MAX - 3);
+    for (int i = 0; i < 6; i++)
+    {
+        buffer.push(records[i & 3]);
+    }
+    CHECK(buffer.size() == 4);
+    CHECK(buffer.front() == "ccc");
+    CHECK(buffer.back() == "bb");
+
+    auto begin = buffer.begin();
+    auto end = buffer.end();
+    CHECK(end - begin == 4);
+    CHECK(begin - end == -4);
+    CHECK(begin < end && end > begin && begin <= end && !(end <= begin));
+    CHECK(begin + 4 == end && 4 + begin == end && end - 4 == begin);
+    CHECK(begin[0] == "ccc" && begin[1] == "dddd" && begin[2] == "a" && begin[3] == "bb");
+
+    auto it = begin;
+    it += 3;
+    CHECK(*it == "bb");
+    it -= 2;
+    CHECK(*it == "dddd");
+    CHECK(*(it++) == "dddd" && *it == "a");
+    CHECK(*(it--) == "a" && *it == "dddd");
+    CHECK((--it) == begin && (++it) - begin == 1);
+
+    std::size_t bytes = 0;
+    int entries = 0;
+    for (const std::string_view &entry : buffer)
+    {
+        bytes += entry.size();
+        entries++;
+    }
+    CHECK(entries == 4);
+    CHECK(bytes == buffer.total_size() && bytes == 10);
+
+    auto [found, offset] = buffer.find_fpos(7);
+    CHECK(found == begin + 2 && offset == 0);
+    std::tie(found, offset) = buffer.find_fpos(9);
+    CHECK(found == begin + 3 && offset == 1);
+}
+
+} // namespace
+
+int main()
+{
+    test_owned_entry_push_pop_evict();
+    test_find_fpos();
+    test_iterator_wraparound();
+
+    if (failures != 0)
+    {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,636 @@
+/**
+ * @file aesdclient.c
+ * @brief Pooled, pipelining client for the aesdsocket binary protocol
+ *
+ * Every connection owns an output buffer of encoded frames, an input buffer of received bytes and
+ * a FIFO of outstanding requests. aesdsocket answers the requests of one connection in order, so
+ * each reply belongs to the oldest outstanding request. Sockets are non blocking and pumped with
+ * poll() in both directions at once, so a deep pipeline can't deadlock with a server that is
+ * blocked writing replies nobody reads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "aesdclient.h"
+
+// queued frames beyond this are pushed to the socket right away instead of waiting for a flush
+#define AESD_CLIENT_FLUSH_BYTES (64 * 1024)
+#define AESD_CLIENT_READ_CHUNK (64 * 1024)
+
+struct byte_buffer
+{
+    char *data;
+    size_t start;
+    size_t end;
+    size_t capacity;
+};
+
+struct pending
+{
+    uint32_t sequence;
+    aesd_completion_cb cb;
+    void *ctx;
+};
+
+struct aesd_conn
+{
+    int fd;
+    // negative errno once the connection failed, 0 while healthy
+    int error;
+    uint32_t next_sequence;
+    struct byte_buffer out;
+    struct byte_buffer in;
+    // ring of outstanding requests, oldest at pending_head
+    struct pending *pending;
+    size_t pending_head;
+    size_t pending_count;
+    size_t pending_capacity;
+    struct aesd_conn *next_idle;
+};
+
+struct aesd_client_pool
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    unsigned int max_conns;
+    unsigned int open_conns;
+    struct aesd_conn *idle;
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+};
+
+static size_t buffer_size(const struct byte_buffer *buffer)
+{
+    return buffer->end - buffer->start;
+}
+
+// make room for at least len more bytes after buffer->end
+static int buffer_reserve(struct byte_buffer *buffer, size_t len)
+{
+    if (buffer->start > 0 && buffer->capacity - buffer->end < len)
+    {
+        memmove(buffer->data, buffer->data + buffer->start, buffer_size(buffer));
+        buffer->end -= buffer->start;
+        buffer->start = 0;
+    }
+    if (buffer->capacity - buffer->end < len)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity - buffer->end < len)
+        {
+            capacity *= 2;
+        }
+        char *data = realloc(buffer->data, capacity);
+        if (data == NULL)
+        {
+            return -ENOMEM;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    return 0;
+}
+
+static void buffer_consume(struct byte_buffer *buffer, size_t len)
+{
+    buffer->start += len;
+    if (buffer->start == buffer->end)
+    {
+        buffer->start = buffer->end = 0;
+    }
+}
+
+// fail every outstanding request and mark the connection unusable
+static int conn_fail(struct aesd_conn *conn, int error)
+{
+    if (conn->error == 0)
+    {
+        conn->error = error;
+    }
+    while (conn->pending_count > 0)
+    {
+        struct pending pending = conn->pending[conn->pending_head];
+        conn->pending_head = (conn->pending_head + 1) % conn->pending_capacity;
+        conn->pending_count--;
+        if (pending.cb != NULL)
+        {
+            pending.cb(pending.ctx, conn->error, NULL, 0);
+        }
+    }
+    conn->out.start = conn->out.end = 0;
+    return conn->error;
+}
+
+// hand every complete reply in the input buffer to its callback
+static int conn_dispatch(struct aesd_conn *conn)
+{
+    while (buffer_size(&conn->in) >= sizeof(struct aesd_frame_header))
+    {
+        struct aesd_frame_header header;
+        memcpy(&header, conn->in.data + conn->in.start, sizeof(header));
+        uint32_t length = ntohl(header.length);
+        if (buffer_size(&conn->in) < sizeof(header) + length)
+        {
+            // make sure the whole body fits before reading on
+            return buffer_reserve(&conn->in, sizeof(header) + length - buffer_size(&conn->in));
+        }
+        if (conn->pending_count == 0 || conn->pending[conn->pending_head].sequence != ntohl(header.sequence))
+        {
+            return conn_fail(conn, -EPROTO);
+        }
+        struct pending pending = conn->pending[conn->pending_head];
+        conn->pending_head = (conn->pending_head + 1) % conn->pending_capacity;
+        conn->pending_count--;
+        if (pending.cb != NULL)
+        {
+            pending.cb(pending.ctx, ntohs(header.status), conn->in.data + conn->in.start + sizeof(header), length);
+        }
+        buffer_consume(&conn->in, sizeof(header) + length);
+    }
+    return 0;
+}
+
+// send queued frames and handle replies until the output buffer is empty and at most max_pending
+// requests are outstanding
+static int conn_pump(struct aesd_conn *conn, size_t max_pending)
+{
+    while (conn->error == 0)
+    {
+        int want_send = buffer_size(&conn->out) > 0;
+        if (!want_send && conn->pending_count <= max_pending)
+        {
+            return 0;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = conn->fd;
+        pfd.events = (want_send ? POLLOUT : 0) | (conn->pending_count > 0 ? POLLIN : 0);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return conn_fail(conn, -errno);
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            if (buffer_reserve(&conn->in, AESD_CLIENT_READ_CHUNK) < 0)
+            {
+                return conn_fail(conn, -ENOMEM);
+            }
+            ssize_t bytes_read = recv(conn->fd, conn->in.data + conn->in.end, conn->in.capacity - conn->in.end, 0);
+            if (bytes_read == 0)
+            {
+                return conn_fail(conn, -ECONNRESET);
+            }
+            if (bytes_read < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                return conn_fail(conn, -errno);
+            }
+            if (bytes_read > 0)
+            {
+                conn->in.end += bytes_read;
+                if (conn_dispatch(conn) < 0)
+                {
+                    return conn_fail(conn, -ENOMEM);
+                }
+            }
+        }
+
+        if (want_send && (pfd.revents & POLLOUT))
+        {
+            ssize_t bytes_sent = send(conn->fd, conn->out.data + conn->out.start, buffer_size(&conn->out), MSG_NOSIGNAL);
+            if (bytes_sent < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                return conn_fail(conn, -errno);
+            }
+            if (bytes_sent > 0)
+            {
+                buffer_consume(&conn->out, bytes_sent);
+            }
+        }
+    }
+    return conn->error;
+}
+
+// encode one request frame and remember its callback
+static int conn_queue(struct aesd_conn *conn, uint16_t opcode, const void *body, uint32_t length,
+                      aesd_completion_cb cb, void *ctx)
+{
+    if (conn->error != 0)
+    {
+        return conn->error;
+    }
+    if (length > AESD_PROTO_MAX_BODY)
+    {
+        return AESD_STATUS_TOO_BIG;
+    }
+    if (conn->pending_count == conn->pending_capacity)
+    {
+        size_t capacity = conn->pending_capacity ? conn->pending_capacity * 2 : 64;
+        struct pending *pending = malloc(capacity * sizeof(struct pending));
+        if (pending == NULL)
+        {
+            return -ENOMEM;
+        }
+        for (size_t i = 0; i < conn->pending_count; i++)
+        {
+            pending[i] = conn->pending[(conn->pending_head + i) % conn->pending_capacity];
+        }
+        free(conn->pending);
+        conn->pending = pending;
+        conn->pending_head = 0;
+        conn->pending_capacity = capacity;
+    }
+    if (buffer_reserve(&conn->out, sizeof(struct aesd_frame_header) + length) < 0)
+    {
+        return -ENOMEM;
+    }
+
+    struct aesd_frame_header header;
+    header.opcode = htons(opcode);
+    header.status = 0;
+    header.length = htonl(length);
+    header.sequence = htonl(conn->next_sequence);
+    memcpy(conn->out.data + conn->out.end, &header, sizeof(header));
+    if (length > 0)
+    {
+        memcpy(conn->out.data + conn->out.end + sizeof(header), body, length);
+    }
+    conn->out.end += sizeof(header) + length;
+
+    struct pending *pending = &conn->pending[(conn->pending_head + conn->pending_count) % conn->pending_capacity];
+    pending->sequence = conn->next_sequence++;
+    pending->cb = cb;
+    pending->ctx = ctx;
+    conn->pending_count++;
+
+    if (buffer_size(&conn->out) >= AESD_CLIENT_FLUSH_BYTES)
+    {
+        return conn_pump(conn, SIZE_MAX);
+    }
+    return 0;
+}
+
+static void conn_close(struct aesd_conn *conn)
+{
+    conn_fail(conn, -ECONNABORTED);
+    if (conn->fd >= 0)
+    {
+        close(conn->fd);
+    }
+    free(conn->out.data);
+    free(conn->in.data);
+    free(conn->pending);
+    free(conn);
+}
+
+// connect, negotiate the binary protocol and switch the socket to non blocking mode
+static struct aesd_conn *conn_open(const struct aesd_client_pool *pool)
+{
+    struct aesd_conn *conn = calloc(1, sizeof(struct aesd_conn));
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+    conn->fd = socket(pool->addr.ss_family, SOCK_STREAM, 0);
+    if (conn->fd < 0)
+    {
+        free(conn);
+        return NULL;
+    }
+    if (connect(conn->fd, (const struct sockaddr *)&pool->addr, pool->addr_len) < 0)
+    {
+        goto fail;
+    }
+    if (pool->addr.ss_family == AF_INET)
+    {
+        // pipelining already batches small frames, don't let Nagle delay the last one
+        int opt = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+
+    struct aesd_proto_hello hello;
+    memcpy(hello.magic, AESD_PROTO_MAGIC, AESD_PROTO_MAGIC_LEN);
+    hello.version = htonl(AESD_PROTO_VERSION);
+    if (send(conn->fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) ||
+        recv(conn->fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello))
+    {
+        goto fail;
+    }
+    if (memcmp(hello.magic, AESD_PROTO_MAGIC, AESD_PROTO_MAGIC_LEN) != 0 || ntohl(hello.version) != AESD_PROTO_VERSION)
+    {
+        errno = EPROTO;
+        goto fail;
+    }
+
+    int flags = fcntl(conn->fd, F_GETFL);
+    if (flags < 0 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        goto fail;
+    }
+    return conn;
+
+fail:
+    {
+        int saved_errno = errno;
+        close(conn->fd);
+        free(conn);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+static struct aesd_client_pool *pool_create(const struct sockaddr *addr, socklen_t addr_len, unsigned int max_conns)
+{
+    struct aesd_client_pool *pool = calloc(1, sizeof(struct aesd_client_pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    memcpy(&pool->addr, addr, addr_len);
+    pool->addr_len = addr_len;
+    pool->max_conns = max_conns ? max_conns : 1;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->released, NULL);
+    return pool;
+}
+
+struct aesd_client_pool *aesd_pool_create_tcp(const char *host, uint16_t port, unsigned int max_conns)
+{
+    struct addrinfo hints;
+    struct addrinfo *result;
+    memset(&hints, 0, sizeof(hints));
+    // aesdsocket only listens on IPv4
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &result) != 0)
+    {
+        return NULL;
+    }
+    struct sockaddr_in addr;
+    memcpy(&addr, result->ai_addr, sizeof(addr));
+    freeaddrinfo(result);
+    addr.sin_port = htons(port);
+    return pool_create((struct sockaddr *)&addr, sizeof(addr), max_conns);
+}
+
+struct aesd_client_pool *aesd_pool_create_unix(const char *path, unsigned int max_conns)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+    return pool_create((struct sockaddr *)&addr, sizeof(addr), max_conns);
+}
+
+void aesd_pool_destroy(struct aesd_client_pool *pool)
+{
+    while (pool->idle != NULL)
+    {
+        struct aesd_conn *conn = pool->idle;
+        pool->idle = conn->next_idle;
+        conn_close(conn);
+    }
+    pthread_cond_destroy(&pool->released);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+struct aesd_conn *aesd_pool_acquire(struct aesd_client_pool *pool)
+{
+    struct aesd_conn *conn = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->idle == NULL && pool->open_conns >= pool->max_conns)
+    {
+        pthread_cond_wait(&pool->released, &pool->mutex);
+    }
+    if (pool->idle != NULL)
+    {
+        conn = pool->idle;
+        pool->idle = conn->next_idle;
+        pthread_mutex_unlock(&pool->mutex);
+        return conn;
+    }
+    // connect without holding the pool lock, the slot is reserved by open_conns
+    pool->open_conns++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    conn = conn_open(pool);
+    if (conn == NULL)
+    {
+        int saved_errno = errno;
+        pthread_mutex_lock(&pool->mutex);
+        pool->open_conns--;
+        pthread_cond_signal(&pool->released);
+        pthread_mutex_unlock(&pool->mutex);
+        errno = saved_errno;
+    }
+    return conn;
+}
+
+void aesd_pool_release(struct aesd_client_pool *pool, struct aesd_conn *conn)
+{
+    conn_pump(conn, 0);
+    pthread_mutex_lock(&pool->mutex);
+    if (conn->error != 0)
+    {
+        pool->open_conns--;
+        pthread_mutex_unlock(&pool->mutex);
+        conn_close(conn);
+        pthread_mutex_lock(&pool->mutex);
+    }
+    else
+    {
+        conn->next_idle = pool->idle;
+        pool->idle = conn;
+    }
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+int aesd_append_async(struct aesd_conn *conn, const void *record, uint32_t length,
+                      aesd_completion_cb cb, void *ctx)
+{
+    return conn_queue(conn, AESD_OP_APPEND, record, length, cb, ctx);
+}
+
+int aesd_seek_async(struct aesd_conn *conn, const struct aesd_seekto *seekto, aesd_completion_cb cb, void *ctx)
+{
+    struct aesd_seekto body;
+    body.write_cmd = htonl(seekto->write_cmd);
+    body.write_cmd_offset = htonl(seekto->write_cmd_offset);
+    return conn_queue(conn, AESD_OP_SEEK, &body, sizeof(body), cb, ctx);
+}
+
+int aesd_range_async(struct aesd_conn *conn, uint64_t offset, uint64_t length, aesd_completion_cb cb, void *ctx)
+{
+    struct aesd_range_request body;
+    body.offset = htobe64(offset);
+    body.length = htobe64(length);
+    return conn_queue(conn, AESD_OP_RANGE, &body, sizeof(body), cb, ctx);
+}
+
+int aesd_stats_async(struct aesd_conn *conn, aesd_completion_cb cb, void *ctx)
+{
+    return conn_queue(conn, AESD_OP_STATS, NULL, 0, cb, ctx);
+}
+
+int aesd_conn_flush(struct aesd_conn *conn)
+{
+    return conn_pump(conn, SIZE_MAX);
+}
+
+int aesd_conn_wait(struct aesd_conn *conn, unsigned int max_pending)
+{
+    return conn_pump(conn, max_pending);
+}
+
+unsigned int aesd_conn_pending(const struct aesd_conn *conn)
+{
+    return conn->pending_count;
+}
+
+// result of a synchronous call, filled by sync_cb
+struct sync_result
+{
+    int status;
+    int keep_body;
+    void *body;
+    size_t length;
+};
+
+static void sync_cb(void *ctx, int status, const void *body, uint32_t length)
+{
+    struct sync_result *result = ctx;
+    // keep the first failure of a batch
+    if (result->status == 0)
+    {
+        result->status = status;
+    }
+    if (result->keep_body && status == 0)
+    {
+        result->body = malloc(length ? length : 1);
+        if (result->body == NULL)
+        {
+            result->status = -ENOMEM;
+            return;
+        }
+        memcpy(result->body, body, length);
+        result->length = length;
+    }
+}
+
+// wait for a request queued with sync_cb and hand its body to the caller
+static int sync_finish(struct aesd_conn *conn, int ret, struct sync_result *result, void **data, size_t *data_length)
+{
+    if (ret == 0)
+    {
+        ret = conn_pump(conn, 0);
+    }
+    if (ret == 0)
+    {
+        ret = result->status;
+    }
+    if (ret == 0 && data != NULL)
+    {
+        *data = result->body;
+        *data_length = result->length;
+    }
+    else
+    {
+        free(result->body);
+    }
+    return ret;
+}
+
+int aesd_append(struct aesd_conn *conn, const void *record, uint32_t length)
+{
+    struct sync_result result = {0, 0, NULL, 0};
+    int ret = aesd_append_async(conn, record, length, sync_cb, &result);
+    return sync_finish(conn, ret, &result, NULL, NULL);
+}
+
+int aesd_append_batch(struct aesd_conn *conn, const struct iovec *records, size_t count)
+{
+    struct sync_result result = {0, 0, NULL, 0};
+    int ret = 0;
+    for (size_t i = 0; i < count && ret == 0; i++)
+    {
+        ret = aesd_append_async(conn, records[i].iov_base, records[i].iov_len, sync_cb, &result);
+    }
+    return sync_finish(conn, ret, &result, NULL, NULL);
+}
+
+int aesd_seek(struct aesd_conn *conn, const struct aesd_seekto *seekto, void **data, size_t *data_length)
+{
+    struct sync_result result = {0, 1, NULL, 0};
+    int ret = aesd_seek_async(conn, seekto, sync_cb, &result);
+    return sync_finish(conn, ret, &result, data, data_length);
+}
+
+int aesd_range(struct aesd_conn *conn, uint64_t offset, uint64_t length, void **data, size_t *data_length)
+{
+    struct sync_result result = {0, 1, NULL, 0};
+    int ret = aesd_range_async(conn, offset, length, sync_cb, &result);
+    return sync_finish(conn, ret, &result, data, data_length);
+}
+
+int aesd_tail(struct aesd_conn *conn, uint64_t length, void **data, size_t *data_length)
+{
+    struct aesd_proto_stats stats;
+    int ret = aesd_stats(conn, &stats);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    uint64_t offset = stats.total_size > length ? stats.total_size - length : 0;
+    return aesd_range(conn, offset, length, data, data_length);
+}
+
+int aesd_stats(struct aesd_conn *conn, struct aesd_proto_stats *stats)
+{
+    struct sync_result result = {0, 1, NULL, 0};
+    void *body;
+    size_t length;
+    int ret = aesd_stats_async(conn, sync_cb, &result);
+    ret = sync_finish(conn, ret, &result, &body, &length);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (length < sizeof(*stats))
+    {
+        free(body);
+        return -EPROTO;
+    }
+    memcpy(stats, body, sizeof(*stats));
+    free(body);
+    stats->total_size = be64toh(stats->total_size);
+    stats->appends = be64toh(stats->appends);
+    stats->appended_bytes = be64toh(stats->appended_bytes);
+    stats->connections = be64toh(stats->connections);
+    stats->rejected = be64toh(stats->rejected);
+    return 0;
+}
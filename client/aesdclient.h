@@ -0,0 +1,110 @@
+/*
+ * aesdclient.h
+ *
+ *  @brief Client library for the aesdsocket binary protocol
+ *
+ *  Connections are kept open in a pool and reused, requests on one connection are pipelined:
+ *  the *_async calls only queue a frame, aesd_conn_flush() sends whatever is queued and
+ *  aesd_conn_wait() collects replies and runs the completion callbacks in request order.
+ *  A connection must only be used by one thread at a time, the pool itself is thread safe.
+ *
+ *  Return values: 0 on success, a positive enum aesd_proto_status when the server refused a
+ *  request, a negative errno value when the connection failed. A failed connection is closed
+ *  instead of being returned to the pool on aesd_pool_release().
+ */
+
+#ifndef AESD_CLIENT_H
+#define AESD_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "../server/aesd_protocol.h"
+
+struct aesd_client_pool;
+struct aesd_conn;
+
+/**
+ * Called once per request when its reply arrived. body is only valid during the call.
+ * When the connection fails before the reply arrived, status is negative and body is NULL.
+ */
+typedef void (*aesd_completion_cb)(void *ctx, int status, const void *body, uint32_t length);
+
+/**
+ * Create a pool opening at most max_conns connections to aesdsocket over TCP or over its unix
+ * domain stream listener. Connections are opened lazily by aesd_pool_acquire().
+ * @return NULL when out of memory or host can't be resolved
+ */
+struct aesd_client_pool *aesd_pool_create_tcp(const char *host, uint16_t port, unsigned int max_conns);
+struct aesd_client_pool *aesd_pool_create_unix(const char *path, unsigned int max_conns);
+
+/**
+ * Close every idle connection and free the pool, all connections must have been released
+ */
+void aesd_pool_destroy(struct aesd_client_pool *pool);
+
+/**
+ * Take an idle connection, open a new one, or wait for a release when max_conns are in use.
+ * @return NULL when a new connection could not be established, errno is set
+ */
+struct aesd_conn *aesd_pool_acquire(struct aesd_client_pool *pool);
+
+/**
+ * Complete every outstanding request of conn and hand it back to the pool
+ */
+void aesd_pool_release(struct aesd_client_pool *pool, struct aesd_conn *conn);
+
+/**
+ * Queue a request. Nothing is sent until aesd_conn_flush() or aesd_conn_wait(), or until
+ * enough frames are queued to fill a socket buffer.
+ */
+int aesd_append_async(struct aesd_conn *conn, const void *record, uint32_t length,
+                      aesd_completion_cb cb, void *ctx);
+int aesd_seek_async(struct aesd_conn *conn, const struct aesd_seekto *seekto, aesd_completion_cb cb, void *ctx);
+int aesd_range_async(struct aesd_conn *conn, uint64_t offset, uint64_t length, aesd_completion_cb cb, void *ctx);
+int aesd_stats_async(struct aesd_conn *conn, aesd_completion_cb cb, void *ctx);
+
+/**
+ * Send every queued request without waiting for replies
+ */
+int aesd_conn_flush(struct aesd_conn *conn);
+
+/**
+ * Send every queued request and run callbacks until at most max_pending requests are left
+ * outstanding, 0 waits for all of them
+ */
+int aesd_conn_wait(struct aesd_conn *conn, unsigned int max_pending);
+
+/**
+ * Number of requests queued or sent whose reply has not been handled yet
+ */
+unsigned int aesd_conn_pending(const struct aesd_conn *conn);
+
+/**
+ * Store one record and wait for the acknowledgement. The record may end with '\n' but not
+ * contain one elsewhere, the server answers that with AESD_STATUS_BAD_REQUEST
+ */
+int aesd_append(struct aesd_conn *conn, const void *record, uint32_t length);
+
+/**
+ * Store count records pipelined on one connection, waiting once for all acknowledgements.
+ * @return the first failure, or 0 when every record was stored
+ */
+int aesd_append_batch(struct aesd_conn *conn, const struct iovec *records, size_t count);
+
+/**
+ * Read everything from the write command described by seekto up to the end, from offset up to
+ * length bytes, or the last length bytes of the storage. On success *data is a malloc'ed buffer
+ * of *data_length bytes owned by the caller.
+ */
+int aesd_seek(struct aesd_conn *conn, const struct aesd_seekto *seekto, void **data, size_t *data_length);
+int aesd_range(struct aesd_conn *conn, uint64_t offset, uint64_t length, void **data, size_t *data_length);
+int aesd_tail(struct aesd_conn *conn, uint64_t length, void **data, size_t *data_length);
+
+/**
+ * Fetch the server counters, converted to host byte order
+ */
+int aesd_stats(struct aesd_conn *conn, struct aesd_proto_stats *stats);
+
+#endif /* AESD_CLIENT_H */
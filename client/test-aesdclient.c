@@ -0,0 +1,250 @@
+/**
+ * @file test-aesdclient.c
+ * @brief Loopback test of the client library against a running aesdsocket
+ *
+ * Starts the aesdsocket binary given on the command line with a unix stream listener next to its
+ * TCP port, then checks hello negotiation over both, a pipelined batch of APPENDs followed by a
+ * RANGE on one connection, the rejection of a record with an embedded newline, and that a
+ * released connection is handed out again instead of a new one. Finally the server gets SIGTERM
+ * while the pool still holds that connection open, and must exit cleanly within a few seconds.
+ * The server should be built with USE_AESD_CHAR_DEVICE=0, so it stores to a file instead of
+ * /dev/aesdchar. Prints one line per failed check and exits non zero if there was any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "aesdclient.h"
+
+#define RECORDS 64
+#define SERVER_PORT 9000
+#define STARTUP_MS 5000
+#define SHUTDOWN_MS 5000
+
+static int failures;
+
+#define CHECK(condition)                                                                  \
+    do                                                                                    \
+    {                                                                                     \
+        if (!(condition))                                                                 \
+        {                                                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                                   \
+        }                                                                                 \
+    } while (0)
+
+// completion order and statuses of the pipelined requests
+struct pipeline
+{
+    int completed;
+    int out_of_order;
+    int failed;
+    void *range;
+    size_t range_length;
+};
+
+struct pipeline_request
+{
+    struct pipeline *pipeline;
+    int index;
+};
+
+static void pipeline_cb(void *ctx, int status, const void *body, uint32_t length)
+{
+    struct pipeline_request *request = ctx;
+    struct pipeline *pipeline = request->pipeline;
+    if (request->index != pipeline->completed)
+    {
+        pipeline->out_of_order++;
+    }
+    if (status != 0)
+    {
+        pipeline->failed++;
+    }
+    pipeline->completed++;
+    // the last request is the RANGE reading the records back
+    if (request->index == RECORDS && status == 0)
+    {
+        pipeline->range = malloc(length ? length : 1);
+        if (pipeline->range != NULL)
+        {
+            memcpy(pipeline->range, body, length);
+            pipeline->range_length = length;
+        }
+    }
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec delay = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&delay, NULL);
+}
+
+static pid_t start_server(const char *server, const char *socket_path)
+{
+    struct stat st;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execl(server, server, "-u", socket_path, (char *)NULL);
+        perror("execl");
+        _exit(127);
+    }
+    // the unix socket is bound after the TCP one, once it exists both accept clients
+    for (int waited = 0; pid > 0 && waited < STARTUP_MS; waited += 10)
+    {
+        if (stat(socket_path, &st) == 0)
+        {
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            return -1;
+        }
+        sleep_ms(10);
+    }
+    return -1;
+}
+
+// SIGTERM the server and wait for it to exit, returns its wait status or -1 on a timeout
+static int stop_server(pid_t pid)
+{
+    int status;
+    kill(pid, SIGTERM);
+    for (int waited = 0; waited < SHUTDOWN_MS; waited += 10)
+    {
+        if (waitpid(pid, &status, WNOHANG) == pid)
+        {
+            return status;
+        }
+        sleep_ms(10);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return -1;
+}
+
+static void test_tcp_hello(void)
+{
+    struct aesd_client_pool *pool = aesd_pool_create_tcp("127.0.0.1", SERVER_PORT, 1);
+    struct aesd_proto_stats stats;
+    CHECK(pool != NULL);
+    if (pool == NULL)
+    {
+        return;
+    }
+    struct aesd_conn *conn = aesd_pool_acquire(pool);
+    CHECK(conn != NULL);
+    if (conn != NULL)
+    {
+        CHECK(aesd_stats(conn, &stats) == 0);
+        aesd_pool_release(pool, conn);
+    }
+    aesd_pool_destroy(pool);
+}
+
+static void test_pipeline(struct aesd_conn *conn)
+{
+    static struct pipeline_request requests[RECORDS + 1];
+    struct pipeline pipeline = { 0, 0, 0, NULL, 0 };
+    struct aesd_proto_stats stats;
+    char expected[RECORDS * 16];
+    size_t expected_length = 0;
+
+    CHECK(aesd_stats(conn, &stats) == 0);
+    for (int i = 0; i < RECORDS; i++)
+    {
+        char record[16];
+        // records without a newline get one appended by the server
+        int length = snprintf(record, sizeof(record), i % 2 ? "record %d\n" : "record %d", i);
+        expected_length += sprintf(expected + expected_length, "record %d\n", i);
+        requests[i].pipeline = &pipeline;
+        requests[i].index = i;
+        CHECK(aesd_append_async(conn, record, length, pipeline_cb, &requests[i]) == 0);
+    }
+    requests[RECORDS].pipeline = &pipeline;
+    requests[RECORDS].index = RECORDS;
+    CHECK(aesd_range_async(conn, stats.total_size, UINT64_MAX, pipeline_cb, &requests[RECORDS]) == 0);
+    CHECK(aesd_conn_pending(conn) == RECORDS + 1);
+
+    CHECK(aesd_conn_wait(conn, 0) == 0);
+    CHECK(aesd_conn_pending(conn) == 0);
+    CHECK(pipeline.completed == RECORDS + 1);
+    CHECK(pipeline.out_of_order == 0);
+    CHECK(pipeline.failed == 0);
+    CHECK(pipeline.range_length == expected_length);
+    CHECK(pipeline.range != NULL && memcmp(pipeline.range, expected, expected_length) == 0);
+    free(pipeline.range);
+
+    CHECK(aesd_append(conn, "two\nlines\n", 10) == AESD_STATUS_BAD_REQUEST);
+    // a refused request leaves the connection usable
+    CHECK(aesd_stats(conn, &stats) == 0);
+}
+
+int main(int argc, char **argv)
+{
+    char socket_path[64];
+    struct aesd_proto_stats before;
+    struct aesd_proto_stats after;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s path/to/aesdsocket\n", argv[0]);
+        return 2;
+    }
+    snprintf(socket_path, sizeof(socket_path), "/tmp/test-aesdclient-%d.sock", (int)getpid());
+    pid_t server = start_server(argv[1], socket_path);
+    if (server < 0)
+    {
+        fprintf(stderr, "%s didn't start\n", argv[1]);
+        return 1;
+    }
+
+    test_tcp_hello();
+
+    struct aesd_client_pool *pool = aesd_pool_create_unix(socket_path, 1);
+    CHECK(pool != NULL);
+    struct aesd_conn *conn = pool != NULL ? aesd_pool_acquire(pool) : NULL;
+    CHECK(conn != NULL);
+    if (conn != NULL)
+    {
+        test_pipeline(conn);
+
+        // the pool hands the released connection out again instead of connecting anew
+        CHECK(aesd_stats(conn, &before) == 0);
+        aesd_pool_release(pool, conn);
+        struct aesd_conn *reused = aesd_pool_acquire(pool);
+        CHECK(reused == conn);
+        CHECK(reused != NULL && aesd_stats(reused, &after) == 0);
+        CHECK(after.connections == before.connections);
+        if (reused != NULL)
+        {
+            aesd_pool_release(pool, reused);
+        }
+    }
+
+    // the pool keeps its idle connection open, the server must exit anyway
+    int status = stop_server(server);
+    CHECK(status != -1);
+    CHECK(status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    if (pool != NULL)
+    {
+        aesd_pool_destroy(pool);
+    }
+    unlink(socket_path);
+
+    if (failures != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,250 @@
+/**
+ * @file aesd_admission.c
+ * @brief Token bucket admission control per source IP for aesdsocket
+ *
+ * Clients are kept in a small hash table of lists protected by one mutex, which is only taken
+ * when at least one limit is configured. Other entries on the list of a client being looked up are
+ * dropped once they have been idle for a while and every bucket has refilled to its burst, from
+ * then on they are indistinguishable from new clients. A client in debt keeps its entry until the
+ * debt is paid off, so reconnecting or waiting briefly doesn't forgive it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "aesd_admission.h"
+
+#define ADMISSION_HASH_SIZE 256
+// entries of clients active this recently are kept without checking their buckets
+#define ADMISSION_IDLE_SEC 5
+
+struct bucket
+{
+    double tokens;
+    double rate;
+};
+
+struct client
+{
+    struct in_addr addr;
+    double last_refill;
+    struct bucket connections;
+    struct bucket append_bytes;
+    struct bucket reply_bytes;
+    LIST_ENTRY(client)
+    clients;
+};
+
+LIST_HEAD(client_list, client);
+
+static struct admission_limits admission_limits;
+static int admission_enabled = 0;
+static struct client_list admission_table[ADMISSION_HASH_SIZE];
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// every bucket holds one second worth of tokens, connection buckets room for at least one
+static double bucket_burst(const struct bucket *bucket)
+{
+    return bucket->rate > 0 && bucket->rate < 1 ? 1 : bucket->rate;
+}
+
+static void bucket_init(struct bucket *bucket, double rate)
+{
+    bucket->rate = rate;
+    bucket->tokens = bucket_burst(bucket);
+}
+
+// whether bucket is back at its burst after elapsed seconds of refilling
+static int bucket_refilled(const struct bucket *bucket, double elapsed)
+{
+    return bucket->rate == 0 || bucket->tokens + elapsed * bucket->rate >= bucket_burst(bucket);
+}
+
+static void bucket_refill(struct bucket *bucket, double elapsed)
+{
+    double burst = bucket_burst(bucket);
+    if (bucket->rate == 0)
+    {
+        return;
+    }
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > burst)
+    {
+        bucket->tokens = burst;
+    }
+}
+
+static unsigned int hash_addr(struct in_addr addr)
+{
+    // fold the address so clients from one subnet spread over the table
+    uint32_t value = addr.s_addr;
+    value ^= value >> 16;
+    value ^= value >> 8;
+    return value % ADMISSION_HASH_SIZE;
+}
+
+// find or create the entry for addr with its buckets refilled up to now, mutex held by caller
+static struct client *lookup_client(struct in_addr addr)
+{
+    double now = now_sec();
+    struct client_list *list = &admission_table[hash_addr(addr)];
+    struct client *client = LIST_FIRST(list);
+    struct client *found = NULL;
+
+    while (client != NULL)
+    {
+        struct client *next = LIST_NEXT(client, clients);
+        if (client->addr.s_addr == addr.s_addr)
+        {
+            found = client;
+        }
+        else if (now - client->last_refill > ADMISSION_IDLE_SEC &&
+                 bucket_refilled(&client->connections, now - client->last_refill) &&
+                 bucket_refilled(&client->append_bytes, now - client->last_refill) &&
+                 bucket_refilled(&client->reply_bytes, now - client->last_refill))
+        {
+            LIST_REMOVE(client, clients);
+            free(client);
+        }
+        client = next;
+    }
+
+    if (found == NULL)
+    {
+        found = malloc(sizeof(struct client));
+        if (found == NULL)
+        {
+            return NULL;
+        }
+        found->addr = addr;
+        bucket_init(&found->connections, admission_limits.connections_per_sec);
+        bucket_init(&found->append_bytes, admission_limits.append_bytes_per_sec);
+        bucket_init(&found->reply_bytes, admission_limits.reply_bytes_per_sec);
+        found->last_refill = now;
+        LIST_INSERT_HEAD(list, found, clients);
+        return found;
+    }
+
+    double elapsed = now - found->last_refill;
+    bucket_refill(&found->connections, elapsed);
+    bucket_refill(&found->append_bytes, elapsed);
+    bucket_refill(&found->reply_bytes, elapsed);
+    found->last_refill = now;
+    return found;
+}
+
+void admission_init(const struct admission_limits *limits)
+{
+    int i;
+    admission_limits = *limits;
+    admission_enabled = limits->connections_per_sec > 0 || limits->append_bytes_per_sec > 0 ||
+                        limits->reply_bytes_per_sec > 0;
+    for (i = 0; i < ADMISSION_HASH_SIZE; i++)
+    {
+        LIST_INIT(&admission_table[i]);
+    }
+}
+
+void admission_cleanup(void)
+{
+    int i;
+    pthread_mutex_lock(&admission_mutex);
+    for (i = 0; i < ADMISSION_HASH_SIZE; i++)
+    {
+        while (!LIST_EMPTY(&admission_table[i]))
+        {
+            struct client *client = LIST_FIRST(&admission_table[i]);
+            LIST_REMOVE(client, clients);
+            free(client);
+        }
+    }
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+int admission_accept(struct in_addr addr)
+{
+    int admitted = 1;
+    if (!admission_enabled)
+    {
+        return 1;
+    }
+    pthread_mutex_lock(&admission_mutex);
+    struct client *client = lookup_client(addr);
+    if (client != NULL)
+    {
+        if ((client->connections.rate > 0 && client->connections.tokens < 1) ||
+            client->append_bytes.tokens < 0 || client->reply_bytes.tokens < 0)
+        {
+            admitted = 0;
+        }
+        else if (client->connections.rate > 0)
+        {
+            client->connections.tokens -= 1;
+        }
+    }
+    pthread_mutex_unlock(&admission_mutex);
+    return admitted;
+}
+
+// check one of the byte buckets of addr for debt
+static int bytes_allowed(struct in_addr addr, int append)
+{
+    int allowed = 1;
+    pthread_mutex_lock(&admission_mutex);
+    struct client *client = lookup_client(addr);
+    if (client != NULL)
+    {
+        struct bucket *bucket = append ? &client->append_bytes : &client->reply_bytes;
+        allowed = bucket->tokens >= 0;
+    }
+    pthread_mutex_unlock(&admission_mutex);
+    return allowed;
+}
+
+int admission_append_allowed(struct in_addr addr)
+{
+    return admission_limits.append_bytes_per_sec == 0 || bytes_allowed(addr, 1);
+}
+
+int admission_reply_allowed(struct in_addr addr)
+{
+    return admission_limits.reply_bytes_per_sec == 0 || bytes_allowed(addr, 0);
+}
+
+static void charge(struct in_addr addr, size_t bytes, int append)
+{
+    pthread_mutex_lock(&admission_mutex);
+    struct client *client = lookup_client(addr);
+    if (client != NULL)
+    {
+        struct bucket *bucket = append ? &client->append_bytes : &client->reply_bytes;
+        bucket->tokens -= bytes;
+    }
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+void admission_charge_append(struct in_addr addr, size_t bytes)
+{
+    if (admission_limits.append_bytes_per_sec > 0)
+    {
+        charge(addr, bytes, 1);
+    }
+}
+
+void admission_charge_reply(struct in_addr addr, size_t bytes)
+{
+    if (admission_limits.reply_bytes_per_sec > 0)
+    {
+        charge(addr, bytes, 0);
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * aesd_admission.h
+ *
+ *  @brief Per client admission control for aesdsocket
+ *
+ *  Every source IP owns three token buckets: connections per second, appended bytes per second
+ *  and reply bytes per second. A connection is only admitted when its IP has a connection token
+ *  left and is not in debt on the byte buckets. Bytes are charged after the work is done, so a
+ *  client that just received a large reply is turned away cheaply at its next accept instead of
+ *  making the server replay the storage again.
+ */
+
+#ifndef AESD_ADMISSION_H
+#define AESD_ADMISSION_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+struct admission_limits
+{
+    /**
+     * Sustained rates per source IP, 0 disables the corresponding limit.
+     * Each bucket holds one second worth of tokens as burst.
+     */
+    double connections_per_sec;
+    double append_bytes_per_sec;
+    double reply_bytes_per_sec;
+};
+
+/**
+ * Set the limits, must be called before any other admission function
+ */
+void admission_init(const struct admission_limits *limits);
+
+/**
+ * Release all per client state
+ */
+void admission_cleanup(void);
+
+/**
+ * Decide whether a new connection from addr is accepted, consumes one connection token when it is.
+ * @return 1 when the connection may be served, 0 when it should be closed right away
+ */
+int admission_accept(struct in_addr addr);
+
+/**
+ * @return 1 when addr may append more data now, 0 when it is in debt on appended bytes
+ */
+int admission_append_allowed(struct in_addr addr);
+
+/**
+ * @return 1 when addr may be sent more data now, 0 when it is in debt on reply bytes
+ */
+int admission_reply_allowed(struct in_addr addr);
+
+/**
+ * Charge work already done for addr, the buckets may go negative
+ */
+void admission_charge_append(struct in_addr addr, size_t bytes);
+void admission_charge_reply(struct in_addr addr, size_t bytes);
+
+#endif /* AESD_ADMISSION_H */
@@ -0,0 +1,246 @@
+/**
+ * @file aesd_profile.c
+ * @brief Per thread perf_event_open counter groups attributed to aesdsocket request stages
+ *
+ * The counters of a thread form one group so a single read() returns all of them. Counters the
+ * machine doesn't offer (no PMU in a VM, perf_event_paranoid too strict for kernel counting) are
+ * left out of the group and reported as unavailable instead of disabling profiling.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "aesd_profile.h"
+
+struct profile_totals
+{
+    uint64_t calls;
+    uint64_t wall_ns;
+    uint64_t values[PROFILE_COUNTERS];
+    // time the counter group was enabled and scheduled, their ratio is the share of the stages
+    // actually counted, the values are scaled up to the enabled time
+    uint64_t enabled_ns;
+    uint64_t running_ns;
+};
+
+struct profile_thread
+{
+    // group leader, -1 while no counter could be opened
+    int leader;
+    int fds[PROFILE_COUNTERS];
+    // order of the counters in the group read format, the leader first
+    int order[PROFILE_COUNTERS];
+    int count;
+};
+
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} profile_events[PROFILE_COUNTERS] = {
+    [PROFILE_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    [PROFILE_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    [PROFILE_CACHE_REFERENCES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, "cache-references"},
+    [PROFILE_CACHE_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+    [PROFILE_CONTEXT_SWITCHES] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches"},
+    [PROFILE_PAGE_FAULTS] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults"},
+    [PROFILE_TASK_CLOCK] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock"},
+};
+
+static const char *profile_stage_names[PROFILE_STAGES] = {
+    [PROFILE_RECV] = "recv",
+    [PROFILE_FRAME] = "frame",
+    [PROFILE_STORE] = "store",
+    [PROFILE_REPLY] = "reply",
+};
+
+static int profile_enabled = 0;
+// counters opened by at least one thread, so the report can tell 0 from unavailable
+static int profile_available[PROFILE_COUNTERS];
+static struct profile_totals profile_totals[PROFILE_STAGES];
+static __thread struct profile_thread profile_thread = {-1, {-1, -1, -1, -1, -1, -1, -1}, {0}, 0};
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+    // measure the calling thread on whatever CPU it runs
+    return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+static int open_counter(int counter, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = profile_events[counter].type;
+    attr.config = profile_events[counter].config;
+    // the kernel multiplexes groups which don't fit the PMU, the times tell how long this one counted
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = group_fd == -1;
+    int fd = perf_event_open(&attr, group_fd);
+    if (fd < 0)
+    {
+        // perf_event_paranoid >= 2 only allows counting user space
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = perf_event_open(&attr, group_fd);
+    }
+    return fd;
+}
+
+void profile_init(int enabled)
+{
+    profile_enabled = enabled;
+}
+
+void profile_thread_start(void)
+{
+    struct profile_thread *thread = &profile_thread;
+    int counter;
+    if (!profile_enabled)
+    {
+        return;
+    }
+    for (counter = 0; counter < PROFILE_COUNTERS; counter++)
+    {
+        int fd = open_counter(counter, thread->leader);
+        thread->fds[counter] = fd;
+        if (fd < 0)
+        {
+            continue;
+        }
+        if (thread->leader < 0)
+        {
+            thread->leader = fd;
+        }
+        thread->order[thread->count++] = counter;
+        __atomic_store_n(&profile_available[counter], 1, __ATOMIC_RELAXED);
+    }
+    if (thread->leader >= 0)
+    {
+        ioctl(thread->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+void profile_thread_stop(void)
+{
+    struct profile_thread *thread = &profile_thread;
+    int counter;
+    for (counter = 0; counter < PROFILE_COUNTERS; counter++)
+    {
+        if (thread->fds[counter] >= 0)
+        {
+            close(thread->fds[counter]);
+            thread->fds[counter] = -1;
+        }
+    }
+    thread->leader = -1;
+    thread->count = 0;
+}
+
+// read the whole group of the calling thread into the raw values and times of mark, values
+// indexed by enum profile_counter
+static void read_counters(struct profile_mark *mark)
+{
+    struct profile_thread *thread = &profile_thread;
+    // nr, time_enabled, time_running, then one value per counter
+    uint64_t buf[3 + PROFILE_COUNTERS];
+    int i;
+    memset(mark->values, 0, sizeof(mark->values));
+    mark->time_enabled = 0;
+    mark->time_running = 0;
+    if (thread->leader < 0 || read(thread->leader, buf, sizeof(buf)) < (ssize_t)(3 * sizeof(uint64_t)))
+    {
+        return;
+    }
+    mark->time_enabled = buf[1];
+    mark->time_running = buf[2];
+    for (i = 0; i < thread->count && (uint64_t)i < buf[0]; i++)
+    {
+        mark->values[thread->order[i]] = buf[3 + i];
+    }
+}
+
+void profile_begin(struct profile_mark *mark)
+{
+    if (!profile_enabled)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &mark->start);
+    read_counters(mark);
+}
+
+void profile_end(const struct profile_mark *mark, enum profile_stage stage)
+{
+    struct profile_totals *totals = &profile_totals[stage];
+    struct profile_mark now;
+    struct timespec end;
+    int counter;
+    if (!profile_enabled)
+    {
+        return;
+    }
+    read_counters(&now);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // the group counted only running of the enabled nanoseconds, extrapolate like perf stat does
+    uint64_t enabled = now.time_enabled - mark->time_enabled;
+    uint64_t running = now.time_running - mark->time_running;
+    double scale = running > 0 && running < enabled ? (double)enabled / running : 1;
+
+    __atomic_fetch_add(&totals->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totals->wall_ns,
+                       (end.tv_sec - mark->start.tv_sec) * 1000000000ULL + end.tv_nsec - mark->start.tv_nsec,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totals->enabled_ns, enabled, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totals->running_ns, running, __ATOMIC_RELAXED);
+    for (counter = 0; counter < PROFILE_COUNTERS; counter++)
+    {
+        __atomic_fetch_add(&totals->values[counter], (uint64_t)((now.values[counter] - mark->values[counter]) * scale),
+                           __ATOMIC_RELAXED);
+    }
+}
+
+void profile_report(void)
+{
+    int stage;
+    int counter;
+    if (!profile_enabled)
+    {
+        return;
+    }
+    for (counter = 0; counter < PROFILE_COUNTERS; counter++)
+    {
+        if (!profile_available[counter])
+        {
+            syslog(LOG_INFO, "profile: %s counter unavailable", profile_events[counter].name);
+        }
+    }
+    for (stage = 0; stage < PROFILE_STAGES; stage++)
+    {
+        const struct profile_totals *totals = &profile_totals[stage];
+        const uint64_t *values = totals->values;
+        double ipc = values[PROFILE_CYCLES] ? (double)values[PROFILE_INSTRUCTIONS] / values[PROFILE_CYCLES] : 0;
+        double miss_rate = values[PROFILE_CACHE_REFERENCES] ?
+                           100.0 * values[PROFILE_CACHE_MISSES] / values[PROFILE_CACHE_REFERENCES] : 0;
+        double mpki = values[PROFILE_INSTRUCTIONS] ?
+                      1000.0 * values[PROFILE_CACHE_MISSES] / values[PROFILE_INSTRUCTIONS] : 0;
+        double on_cpu = totals->wall_ns ? 100.0 * values[PROFILE_TASK_CLOCK] / totals->wall_ns : 0;
+        double counted = totals->enabled_ns ? 100.0 * totals->running_ns / totals->enabled_ns : 0;
+        syslog(LOG_INFO,
+               "profile: %-5s calls %llu wall %.3f ms on-cpu %.1f%% cycles %llu instructions %llu ipc %.2f "
+               "cache-references %llu cache-misses %llu miss-rate %.2f%% mpki %.2f context-switches %llu "
+               "page-faults %llu counted %.1f%%",
+               profile_stage_names[stage], (unsigned long long)totals->calls, totals->wall_ns / 1e6, on_cpu,
+               (unsigned long long)values[PROFILE_CYCLES], (unsigned long long)values[PROFILE_INSTRUCTIONS], ipc,
+               (unsigned long long)values[PROFILE_CACHE_REFERENCES], (unsigned long long)values[PROFILE_CACHE_MISSES],
+               miss_rate, mpki, (unsigned long long)values[PROFILE_CONTEXT_SWITCHES],
+               (unsigned long long)values[PROFILE_PAGE_FAULTS], counted);
+    }
+}
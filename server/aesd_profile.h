@@ -0,0 +1,71 @@
+/*
+ * aesd_profile.h
+ *
+ *  @brief Built in per stage profiling for aesdsocket based on perf_event_open counters
+ *
+ *  Every client thread opens its own counter group for cycles, instructions, cache references and
+ *  misses, context switches, page faults and on-CPU time. Code brackets each request stage with
+ *  profile_begin()/profile_end(), which read the group once each and add the difference to the
+ *  stage totals, scaled up when the kernel multiplexed the group off the PMU for part of the stage.
+ *  profile_report() logs IPC, the cache miss rate (misses per reference), cache misses per 1000
+ *  instructions and the share of wall time spent on CPU for each stage: a low share means the stage
+ *  waits in system calls rather than computes.
+ *  All calls are cheap no-ops unless profiling was enabled with profile_init().
+ */
+
+#ifndef AESD_PROFILE_H
+#define AESD_PROFILE_H
+
+#include <stdint.h>
+#include <time.h>
+
+enum profile_stage
+{
+    PROFILE_RECV,
+    PROFILE_FRAME,
+    PROFILE_STORE,
+    PROFILE_REPLY,
+    PROFILE_STAGES,
+};
+
+enum profile_counter
+{
+    PROFILE_CYCLES,
+    PROFILE_INSTRUCTIONS,
+    PROFILE_CACHE_REFERENCES,
+    PROFILE_CACHE_MISSES,
+    PROFILE_CONTEXT_SWITCHES,
+    PROFILE_PAGE_FAULTS,
+    PROFILE_TASK_CLOCK,
+    PROFILE_COUNTERS,
+};
+
+/**
+ * Counter snapshot taken by profile_begin()
+ */
+struct profile_mark
+{
+    uint64_t values[PROFILE_COUNTERS];
+    // nanoseconds the group was enabled and actually counting, which differ when multiplexed
+    uint64_t time_enabled;
+    uint64_t time_running;
+    struct timespec start;
+};
+
+void profile_init(int enabled);
+
+/**
+ * Open and close the counters of the calling thread
+ */
+void profile_thread_start(void);
+void profile_thread_stop(void);
+
+void profile_begin(struct profile_mark *mark);
+void profile_end(const struct profile_mark *mark, enum profile_stage stage);
+
+/**
+ * Log the accumulated per stage totals to syslog
+ */
+void profile_report(void);
+
+#endif /* AESD_PROFILE_H */
@@ -0,0 +1,124 @@
+/*
+ * aesd_protocol.h
+ *
+ *  @brief Definitions for the length-prefixed binary protocol served by aesdsocket
+ *
+ *  The newline protocol is still the default. A client switches its connection to the binary
+ *  protocol by sending a struct aesd_proto_hello before anything else. From then on every request
+ *  and every reply is a struct aesd_frame_header followed by exactly header.length body bytes, so
+ *  neither side has to scan frames for '\n'. The storage still separates records with '\n', so
+ *  an APPEND body may only contain one as its last byte, see AESD_OP_APPEND. Reply bodies are the
+ *  stored records, each ending with '\n'.
+ *  All multi-byte fields travel in network byte order.
+ */
+
+#ifndef AESD_PROTOCOL_H
+#define AESD_PROTOCOL_H
+
+#include <stdint.h>
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+/**
+ * First byte of the hello. 0xAE is not printable, so a newline protocol client never starts with it
+ */
+#define AESD_PROTO_MAGIC0 0xAE
+#define AESD_PROTO_MAGIC "\xAE" "SDB"
+#define AESD_PROTO_MAGIC_LEN 4
+#define AESD_PROTO_VERSION 1
+
+/**
+ * Largest request body the server accepts, replies are not limited
+ */
+#define AESD_PROTO_MAX_BODY (16 * 1024 * 1024)
+
+/**
+ * Sent by the client to select the binary protocol, echoed back by the server with the version
+ * it is going to speak
+ */
+struct aesd_proto_hello {
+    char magic[AESD_PROTO_MAGIC_LEN];
+    uint32_t version;
+};
+
+struct aesd_frame_header {
+    /**
+     * One of enum aesd_proto_opcode, or'ed with AESD_OP_REPLY in replies
+     */
+    uint16_t opcode;
+    /**
+     * One of enum aesd_proto_status, always AESD_STATUS_OK in requests
+     */
+    uint16_t status;
+    /**
+     * Number of body bytes following the header
+     */
+    uint32_t length;
+    /**
+     * Chosen by the client and echoed in the reply, so requests can be pipelined
+     */
+    uint32_t sequence;
+};
+
+enum aesd_proto_opcode {
+    /**
+     * Body is the record to store. A '\n' is added when the record does not end with one, and a
+     * body holding a '\n' anywhere before its last byte is rejected with AESD_STATUS_BAD_REQUEST,
+     * since the storage would split it into several records
+     */
+    AESD_OP_APPEND = 1,
+    /**
+     * Body is a struct aesd_seekto, the reply carries everything from that position to the end
+     */
+    AESD_OP_SEEK = 2,
+    /**
+     * Body is a struct aesd_range_request, the reply carries at most length bytes from offset
+     */
+    AESD_OP_RANGE = 3,
+    /**
+     * Empty body, the reply carries a struct aesd_proto_stats
+     */
+    AESD_OP_STATS = 4,
+};
+
+#define AESD_OP_REPLY 0x8000
+
+enum aesd_proto_status {
+    AESD_STATUS_OK = 0,
+    AESD_STATUS_BAD_OPCODE = 1,
+    AESD_STATUS_BAD_REQUEST = 2,
+    AESD_STATUS_TOO_BIG = 3,
+    AESD_STATUS_IO_ERROR = 4,
+    AESD_STATUS_UNSUPPORTED = 5,
+    /**
+     * The client used up its admission budget, retry later
+     */
+    AESD_STATUS_THROTTLED = 6,
+};
+
+struct aesd_range_request {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct aesd_proto_stats {
+    /**
+     * Bytes currently held by the storage
+     */
+    uint64_t total_size;
+    /**
+     * Records and bytes appended through this server since it started
+     */
+    uint64_t appends;
+    uint64_t appended_bytes;
+    /**
+     * Connections accepted since the server started
+     */
+    uint64_t connections;
+    /**
+     * Connections turned away by admission control
+     */
+    uint64_t rejected;
+};
+
+#endif /* AESD_PROTOCOL_H */
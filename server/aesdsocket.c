@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <syslog.h>
 #include <netinet/in.h>
@@ -15,17 +17,27 @@
 #include <pthread.h>
 
 #include <sys/queue.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <endian.h>
 
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesd_protocol.h"
+#include "aesd_admission.h"
+#include "aesd_profile.h"
 
 #define PORT 9000
 #define BUFF_SIZE 100 + 1 // +1 for null character
+#define REPLY_BUFF_SIZE 4096
 // #define EXIT_FAILURE -1
 
 int sk = -1;
 
 int exit_flag = 0;
 
+// counters reported by AESD_OP_STATS, protected by the storage mutex except for connections
+struct aesd_proto_stats server_stats;
+
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
 #endif
@@ -42,8 +54,10 @@ struct node
     pthread_t tid;
     int client_sk;
     int fd;
-    // client address
+    // client address, only set for TRANSPORT_TCP
     struct sockaddr_in client_addr;
+    // listener the client came from
+    int transport;
     // mutex reference
     pthread_mutex_t *mutex;
     // finished flag
@@ -53,6 +67,50 @@ struct node
     nodes;
 };
 
+// listeners aesdsocket can accept clients on
+enum transport
+{
+    TRANSPORT_TCP,
+    TRANSPORT_UNIX_STREAM,
+    TRANSPORT_UNIX_SEQPACKET,
+};
+
+// printable client address for syslog, unix domain clients have none
+static const char *client_name(const struct node *node)
+{
+    switch (node->transport)
+    {
+    case TRANSPORT_UNIX_STREAM:
+        return "unix stream client";
+    case TRANSPORT_UNIX_SEQPACKET:
+        return "unix seqpacket client";
+    default:
+        return inet_ntoa(node->client_addr.sin_addr);
+    }
+}
+
+// admission control only knows TCP clients, unix domain clients are local producers
+static int is_admission_controlled(const struct node *node)
+{
+    return node->transport == TRANSPORT_TCP;
+}
+
+static void charge_append(const struct node *node, size_t bytes)
+{
+    if (is_admission_controlled(node))
+    {
+        admission_charge_append(node->client_addr.sin_addr, bytes);
+    }
+}
+
+static void charge_reply(const struct node *node, size_t bytes)
+{
+    if (is_admission_controlled(node))
+    {
+        admission_charge_reply(node->client_addr.sin_addr, bytes);
+    }
+}
+
 #define JOIN_FINISHED_THREADS(node, head, nodes)          \
     TAILQ_FOREACH(node, &head, nodes)                     \
     {                                                     \
@@ -69,22 +127,176 @@ struct node
         }                                                 \
     }
 
-// thread function
-static void *thread_start(void *arg)
+// read exactly len bytes, returns 0 on success and -1 when the peer closed, the read failed or
+// the server is exiting
+static int read_full(int fd, void *buf, size_t len)
 {
-    struct node *node = arg;
+    char *ptr = buf;
+    while (len > 0)
+    {
+        if (__atomic_load_n(&exit_flag, __ATOMIC_RELAXED) != 0)
+        {
+            return -1;
+        }
+        ssize_t bytes_read = read(fd, ptr, len);
+        if (bytes_read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_read <= 0)
+        {
+            return -1;
+        }
+        ptr += bytes_read;
+        len -= bytes_read;
+    }
+    return 0;
+}
+
+// write exactly len bytes, returns 0 on success and -1 on failure
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *ptr = buf;
+    while (len > 0)
+    {
+        ssize_t bytes_written = write(fd, ptr, len);
+        if (bytes_written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_written <= 0)
+        {
+            return -1;
+        }
+        ptr += bytes_written;
+        len -= bytes_written;
+    }
+    return 0;
+}
+
+// append one complete record to the storage, returns 0 on success and -1 on failure
+static int store_record(struct node *node, const char *record, size_t length)
+{
+    int ret = 0;
+    struct profile_mark mark;
+    profile_begin(&mark);
+    pthread_mutex_lock(node->mutex);
+    int fd = open(AESD_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "open() failed");
+        exit(EXIT_FAILURE);
+    }
+    if (write_full(fd, record, length) < 0)
+    {
+        syslog(LOG_ERR, "write() failed %s", strerror(errno));
+        ret = -1;
+    }
+    else
+    {
+        server_stats.appends++;
+        server_stats.appended_bytes += length;
+    }
+    close(fd);
+    pthread_mutex_unlock(node->mutex);
+    profile_end(&mark, PROFILE_STORE);
+    if (ret == 0)
+    {
+        charge_append(node, length);
+    }
+    return ret;
+}
+
+// send the storage contents to the client, starting at the write command described by command
+// (device only), storage mutex is taken here
+static void reply_storage(struct node *node, const struct aesd_seekto *command)
+{
+    struct profile_mark mark;
+    profile_begin(&mark);
+
+    // lock mutex
+    pthread_mutex_lock(node->mutex);
+    
+    // save fd position
+    off_t fd_pos = lseek(node->fd, 0, SEEK_CUR);
+    
+    node->fd = open(AESD_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (node->fd < 0)
+    {
+        syslog(LOG_ERR, "open() failed");
+        exit(EXIT_FAILURE);
+    }
 
+#if USE_AESD_CHAR_DEVICE == 1
+    // ioctl to with command index and command offset
+    if (ioctl(node->fd, AESDCHAR_IOCSEEKTO, command) != 0)
+    {
+        syslog(LOG_ERR, "ioctl() failed");
+        exit(EXIT_FAILURE);
+    }
+#else
+    // lseek to the beginning of the file
+    if (lseek(node->fd, 0, SEEK_SET) != 0)
+    {
+        syslog(LOG_ERR, "can't lseek to beginning");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    char buf[REPLY_BUFF_SIZE];
+    size_t bytes_sent = 0;
+    while (1)
+    {
+        int bytes_read = read(node->fd, buf, sizeof(buf));
+        if (bytes_read < 0)
+        {
+            syslog(LOG_ERR, "read() failed");
+            exit(EXIT_FAILURE);
+        }
+
+        if (bytes_read == 0)
+        {
+            break;
+        }
+
+        int bytes_written = write(node->client_sk, buf, bytes_read);
+        if (bytes_written < 0)
+        {
+            syslog(LOG_ERR, "write() failed");
+            exit(EXIT_FAILURE);
+        }
+        bytes_sent += bytes_written;
+    }
+
+    // lseek to the saved position
+    lseek(node->fd, fd_pos, SEEK_SET);
+
+    close(node->fd);
+
+    // unlock mutex
+    pthread_mutex_unlock(node->mutex);
+
+    profile_end(&mark, PROFILE_REPLY);
+    charge_reply(node, bytes_sent);
+}
+
+// newline protocol: read until the first new line, store it and reply with the whole storage
+static void serve_text(struct node *node)
+{
     char buf[BUFF_SIZE];
     buf[BUFF_SIZE - 1] = '\0';
 
     int new_line = 0;
+    struct profile_mark mark;
 #if USE_AESD_CHAR_DEVICE == 1
     struct aesd_seekto command = {0, 0};
 #endif
 
     while (new_line == 0)
     {
+        profile_begin(&mark);
         int bytes_read = read(node->client_sk, buf, sizeof(buf));
+        profile_end(&mark, PROFILE_RECV);
         if (bytes_read < 0)
         {
             syslog(LOG_ERR, "read() failed");
@@ -96,6 +308,7 @@ static void *thread_start(void *arg)
             break;
         }
 
+        profile_begin(&mark);
         // find the new line character using strchr
         char *new_line_ptr = strchr(buf, '\n');
         if (new_line_ptr != NULL)
@@ -112,6 +325,7 @@ static void *thread_start(void *arg)
                 // if ioctl is supplied, make ioctl system call
                 syslog(LOG_INFO, "ioctl command received");
                 syslog(LOG_INFO, "command_index: %d, offset_in_command: %d", command_index, offset_in_command);
+                profile_end(&mark, PROFILE_FRAME);
                 break;
             }
 #endif
@@ -119,7 +333,9 @@ static void *thread_start(void *arg)
             bytes_read = (new_line_ptr - buf) + 1;
             new_line = 1;
         }
+        profile_end(&mark, PROFILE_FRAME);
 
+        profile_begin(&mark);
         // lock the mutex
         pthread_mutex_lock(node->mutex);
         node->fd = open(AESD_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
@@ -138,77 +354,433 @@ static void *thread_start(void *arg)
 
         close(node->fd);
 
+        server_stats.appended_bytes += bytes_written;
+        server_stats.appends += new_line;
+
         // unlock the mutex
         pthread_mutex_unlock(node->mutex);
+        profile_end(&mark, PROFILE_STORE);
+
+        charge_append(node, bytes_written);
     }
 
 
 
-    // lock mutex
+#if USE_AESD_CHAR_DEVICE == 1
+    reply_storage(node, &command);
+#else
+    reply_storage(node, NULL);
+#endif
+}
+
+// send a reply header followed by an optional body in one system call
+static int send_reply(struct node *node, uint16_t opcode, uint16_t status, uint32_t sequence,
+                      const void *body, uint32_t length)
+{
+    struct aesd_frame_header header;
+    header.opcode = htons(opcode | AESD_OP_REPLY);
+    header.status = htons(status);
+    header.length = htonl(length);
+    header.sequence = htonl(sequence);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = body != NULL ? length : 0;
+
+    size_t total = iov[0].iov_len + iov[1].iov_len;
+    ssize_t bytes_written = writev(node->client_sk, iov, 2);
+    if (bytes_written < 0)
+    {
+        return -1;
+    }
+    if ((size_t)bytes_written < total)
+    {
+        // finish a short write byte-wise from wherever writev stopped
+        if ((size_t)bytes_written < sizeof(header))
+        {
+            if (write_full(node->client_sk, (char *)&header + bytes_written, sizeof(header) - bytes_written) < 0)
+            {
+                return -1;
+            }
+            bytes_written = sizeof(header);
+        }
+        return write_full(node->client_sk, (const char *)body + (bytes_written - sizeof(header)),
+                          total - bytes_written);
+    }
+    return 0;
+}
+
+// reply with length bytes read from the current position of fd, storage mutex held by caller
+static int send_storage(struct node *node, uint16_t opcode, uint32_t sequence, int fd, uint32_t length)
+{
+    char buf[64 * 1024];
+    int use_sendfile = 1;
+    if (send_reply(node, opcode, AESD_STATUS_OK, sequence, NULL, length) < 0)
+    {
+        return -1;
+    }
+    while (length > 0)
+    {
+        if (use_sendfile)
+        {
+            // splice the storage into the socket without copying it through buf, a driver
+            // without splice support fails before sending anything
+            ssize_t bytes_sent = sendfile(node->client_sk, fd, NULL, length);
+            if (bytes_sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes_sent < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                use_sendfile = 0;
+                continue;
+            }
+            if (bytes_sent <= 0)
+            {
+                syslog(LOG_ERR, "storage ended before the announced reply length");
+                return -1;
+            }
+            length -= bytes_sent;
+            charge_reply(node, bytes_sent);
+            continue;
+        }
+        size_t chunk = length < sizeof(buf) ? length : sizeof(buf);
+        ssize_t bytes_read = read(fd, buf, chunk);
+        if (bytes_read <= 0)
+        {
+            // the header already promised length bytes, the framing can't be recovered
+            syslog(LOG_ERR, "storage ended before the announced reply length");
+            return -1;
+        }
+        if (write_full(node->client_sk, buf, bytes_read) < 0)
+        {
+            return -1;
+        }
+        length -= bytes_read;
+        charge_reply(node, bytes_read);
+    }
+    return 0;
+}
+
+static int binary_append(struct node *node, uint32_t sequence, char *body, uint32_t length)
+{
+    // every append is one record: a new line inside it would make the storage split it, and
+    // a terminating one makes the storage commit it right away
+    if (length > 1 && memchr(body, '\n', length - 1) != NULL)
+    {
+        return send_reply(node, AESD_OP_APPEND, AESD_STATUS_BAD_REQUEST, sequence, NULL, 0);
+    }
+    // body has room for one extra byte
+    if (length == 0 || body[length - 1] != '\n')
+    {
+        body[length++] = '\n';
+    }
+
+    if (is_admission_controlled(node) && !admission_append_allowed(node->client_addr.sin_addr))
+    {
+        return send_reply(node, AESD_OP_APPEND, AESD_STATUS_THROTTLED, sequence, NULL, 0);
+    }
+    int status = store_record(node, body, length) == 0 ? AESD_STATUS_OK : AESD_STATUS_IO_ERROR;
+
+    struct profile_mark mark;
+    profile_begin(&mark);
+    int ret = send_reply(node, AESD_OP_APPEND, status, sequence, NULL, 0);
+    profile_end(&mark, PROFILE_REPLY);
+    return ret;
+}
+
+// reply with the storage contents starting at offset (from the start when seekto is NULL) up to
+// max_length bytes, or with everything after the command described by seekto
+static int binary_read(struct node *node, uint16_t opcode, uint32_t sequence,
+                       const struct aesd_seekto *seekto, uint64_t offset, uint64_t max_length)
+{
+    int ret;
+    if (is_admission_controlled(node) && !admission_reply_allowed(node->client_addr.sin_addr))
+    {
+        return send_reply(node, opcode, AESD_STATUS_THROTTLED, sequence, NULL, 0);
+    }
+
     pthread_mutex_lock(node->mutex);
-    
-    // save fd position
-    off_t fd_pos = lseek(node->fd, 0, SEEK_CUR);
-    
-    node->fd = open(AESD_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
-    if (node->fd < 0)
+    int fd = open(AESD_FILE, O_RDONLY | O_CREAT, 0644);
+    if (fd < 0)
     {
         syslog(LOG_ERR, "open() failed");
         exit(EXIT_FAILURE);
     }
 
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (seekto != NULL)
+    {
 #if USE_AESD_CHAR_DEVICE == 1
-    // ioctl to with command index and command offset
-    if (ioctl(node->fd, AESDCHAR_IOCSEEKTO, &command) != 0)
+        if (ioctl(fd, AESDCHAR_IOCSEEKTO, seekto) != 0)
+        {
+            ret = send_reply(node, opcode, AESD_STATUS_BAD_REQUEST, sequence, NULL, 0);
+            goto out;
+        }
+        offset = lseek(fd, 0, SEEK_CUR);
+#else
+        ret = send_reply(node, opcode, AESD_STATUS_UNSUPPORTED, sequence, NULL, 0);
+        goto out;
+#endif
+    }
+    else if (end < 0 || offset > (uint64_t)end || lseek(fd, offset, SEEK_SET) < 0)
     {
-        syslog(LOG_ERR, "ioctl() failed");
-        exit(EXIT_FAILURE);
+        ret = send_reply(node, opcode, AESD_STATUS_BAD_REQUEST, sequence, NULL, 0);
+        goto out;
     }
-#else
-    // lseek to the beginning of the file
-    if (lseek(node->fd, 0, SEEK_SET) != 0)
+
+    uint64_t length = end - offset;
+    if (length > max_length)
     {
-        syslog(LOG_ERR, "can't lseek to beginning");
+        length = max_length;
+    }
+    if (length > UINT32_MAX)
+    {
+        length = UINT32_MAX;
+    }
+    ret = send_storage(node, opcode, sequence, fd, length);
+
+out:
+    close(fd);
+    pthread_mutex_unlock(node->mutex);
+    return ret;
+}
+
+static int binary_stats(struct node *node, uint32_t sequence)
+{
+    struct aesd_proto_stats stats;
+
+    pthread_mutex_lock(node->mutex);
+    int fd = open(AESD_FILE, O_RDONLY | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "open() failed");
         exit(EXIT_FAILURE);
     }
-#endif
+    off_t end = lseek(fd, 0, SEEK_END);
+    close(fd);
+    stats.total_size = htobe64(end < 0 ? 0 : end);
+    stats.appends = htobe64(server_stats.appends);
+    stats.appended_bytes = htobe64(server_stats.appended_bytes);
+    stats.connections = htobe64(__atomic_load_n(&server_stats.connections, __ATOMIC_RELAXED));
+    stats.rejected = htobe64(__atomic_load_n(&server_stats.rejected, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(node->mutex);
 
-    while (1)
+    return send_reply(node, AESD_OP_STATS, AESD_STATUS_OK, sequence, &stats, sizeof(stats));
+}
+
+// binary protocol: serve length-prefixed frames until the client closes the connection
+static void serve_binary(struct node *node)
+{
+    struct aesd_proto_hello hello;
+    if (read_full(node->client_sk, &hello, sizeof(hello)) < 0 ||
+        memcmp(hello.magic, AESD_PROTO_MAGIC, AESD_PROTO_MAGIC_LEN) != 0)
     {
-        int bytes_read = read(node->fd, buf, sizeof(buf));
-        if (bytes_read < 0)
+        syslog(LOG_ERR, "bad binary protocol hello");
+        return;
+    }
+    // only one version exists so far, answer with it whatever the client offered
+    hello.version = htonl(AESD_PROTO_VERSION);
+    if (write_full(node->client_sk, &hello, sizeof(hello)) < 0)
+    {
+        return;
+    }
+
+    char *body = NULL;
+    size_t body_capacity = 0;
+    int ret = 0;
+    while (ret == 0)
+    {
+        struct aesd_frame_header header;
+        struct profile_mark mark;
+        profile_begin(&mark);
+        if (read_full(node->client_sk, &header, sizeof(header)) < 0)
         {
-            syslog(LOG_ERR, "read() failed");
-            exit(EXIT_FAILURE);
+            break;
         }
+        profile_end(&mark, PROFILE_RECV);
 
-        if (bytes_read == 0)
+        profile_begin(&mark);
+        uint16_t opcode = ntohs(header.opcode);
+        uint32_t length = ntohl(header.length);
+        uint32_t sequence = ntohl(header.sequence);
+
+        if (length > AESD_PROTO_MAX_BODY)
         {
+            // the body can't be skipped cheaply, refuse and drop the connection
+            send_reply(node, opcode, AESD_STATUS_TOO_BIG, sequence, NULL, 0);
             break;
         }
+        // one spare byte lets append terminate the record in place
+        if (length + 1 > body_capacity)
+        {
+            char *new_body = realloc(body, length + 1);
+            if (new_body == NULL)
+            {
+                syslog(LOG_ERR, "realloc() failed");
+                break;
+            }
+            body = new_body;
+            body_capacity = length + 1;
+        }
+        profile_end(&mark, PROFILE_FRAME);
 
-        int bytes_written = write(node->client_sk, buf, bytes_read);
-        if (bytes_written < 0)
+        profile_begin(&mark);
+        if (read_full(node->client_sk, body, length) < 0)
         {
-            syslog(LOG_ERR, "write() failed");
-            exit(EXIT_FAILURE);
+            break;
+        }
+        profile_end(&mark, PROFILE_RECV);
+
+        switch (opcode)
+        {
+        case AESD_OP_APPEND:
+            ret = binary_append(node, sequence, body, length);
+            break;
+        case AESD_OP_SEEK:
+        {
+            struct aesd_seekto seekto;
+            if (length != sizeof(seekto))
+            {
+                ret = send_reply(node, opcode, AESD_STATUS_BAD_REQUEST, sequence, NULL, 0);
+                break;
+            }
+            memcpy(&seekto, body, sizeof(seekto));
+            seekto.write_cmd = ntohl(seekto.write_cmd);
+            seekto.write_cmd_offset = ntohl(seekto.write_cmd_offset);
+            profile_begin(&mark);
+            ret = binary_read(node, opcode, sequence, &seekto, 0, UINT64_MAX);
+            profile_end(&mark, PROFILE_REPLY);
+            break;
+        }
+        case AESD_OP_RANGE:
+        {
+            struct aesd_range_request range;
+            if (length != sizeof(range))
+            {
+                ret = send_reply(node, opcode, AESD_STATUS_BAD_REQUEST, sequence, NULL, 0);
+                break;
+            }
+            memcpy(&range, body, sizeof(range));
+            profile_begin(&mark);
+            ret = binary_read(node, opcode, sequence, NULL, be64toh(range.offset), be64toh(range.length));
+            profile_end(&mark, PROFILE_REPLY);
+            break;
+        }
+        case AESD_OP_STATS:
+            profile_begin(&mark);
+            ret = binary_stats(node, sequence);
+            profile_end(&mark, PROFILE_REPLY);
+            break;
+        default:
+            ret = send_reply(node, opcode, AESD_STATUS_BAD_OPCODE, sequence, NULL, 0);
         }
     }
+    free(body);
+}
 
-    // lseek to the saved position
-    lseek(node->fd, fd_pos, SEEK_SET);
+// seqpacket protocol: every message is one record, so no new line scanning is needed.
+// Replies like the newline protocol with the whole storage, one message per chunk
+static void serve_seqpacket(struct node *node)
+{
+    struct profile_mark mark;
+    profile_begin(&mark);
+    // with MSG_TRUNC recv reports the full message length even when peeking into one byte
+    char probe;
+    ssize_t length = recv(node->client_sk, &probe, 1, MSG_PEEK | MSG_TRUNC);
+    if (length <= 0)
+    {
+        return;
+    }
+    // one spare byte for the terminating new line or string end
+    char *record = malloc(length + 1);
+    if (record == NULL)
+    {
+        syslog(LOG_ERR, "malloc() failed");
+        return;
+    }
+    ssize_t bytes_read = recv(node->client_sk, record, length, 0);
+    if (bytes_read <= 0)
+    {
+        free(record);
+        return;
+    }
+    profile_end(&mark, PROFILE_RECV);
 
-    close(node->fd);
+    profile_begin(&mark);
 
-    // unlock mutex
-    pthread_mutex_unlock(node->mutex);
+#if USE_AESD_CHAR_DEVICE == 1
+    struct aesd_seekto command = {0, 0};
+    int command_index = 0;
+    int offset_in_command = 0;
+    record[bytes_read] = '\0';
+    if (sscanf(record, "AESDCHAR_IOCSEEKTO:%d,%d", &command_index, &offset_in_command) == 2)
+    {
+        command.write_cmd = command_index;
+        command.write_cmd_offset = offset_in_command;
+        free(record);
+        profile_end(&mark, PROFILE_FRAME);
+        reply_storage(node, &command);
+        return;
+    }
+#endif
+    // one message is one command: the storage splits records at '\n', so like a binary APPEND the
+    // record may only end with one
+    if (bytes_read > 1 && memchr(record, '\n', bytes_read - 1) != NULL)
+    {
+        syslog(LOG_ERR, "seqpacket record with an embedded new line from %s", client_name(node));
+        free(record);
+        profile_end(&mark, PROFILE_FRAME);
+        return;
+    }
+    if (record[bytes_read - 1] != '\n')
+    {
+        record[bytes_read++] = '\n';
+    }
+    profile_end(&mark, PROFILE_FRAME);
+    int ret = store_record(node, record, bytes_read);
+    free(record);
+    if (ret == 0)
+    {
+#if USE_AESD_CHAR_DEVICE == 1
+        reply_storage(node, &command);
+#else
+        reply_storage(node, NULL);
+#endif
+    }
+}
+
+// thread function
+static void *thread_start(void *arg)
+{
+    struct node *node = arg;
+    unsigned char first_byte;
+
+    profile_thread_start();
+
+    // binary protocol clients open with a hello, everything else speaks the newline protocol
+    if (node->transport == TRANSPORT_UNIX_SEQPACKET)
+    {
+        serve_seqpacket(node);
+    }
+    else if (recv(node->client_sk, &first_byte, 1, MSG_PEEK) == 1 && first_byte == AESD_PROTO_MAGIC0)
+    {
+        serve_binary(node);
+    }
+    else
+    {
+        serve_text(node);
+    }
 
     // syslog that connection closed
-    syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(node->client_addr.sin_addr));
+    syslog(LOG_INFO, "Closed connection from %s", client_name(node));
 
     close(node->client_sk);
 
-    node->finished = 1;
+    profile_thread_stop();
+    __atomic_store_n(&node->finished, 1, __ATOMIC_RELEASE);
 
     return arg;
 }
@@ -294,6 +866,71 @@ static void signal_handler(int signo)
     }
 }
 
+// create a unix domain listener of the given socket type on path, replacing a stale socket file
+static int listen_unix(const char *path, int type)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        syslog(LOG_ERR, "unix socket path too long: %s", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, type, 0);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "socket() failed");
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        syslog(LOG_ERR, "bind() failed for %s", path);
+        exit(EXIT_FAILURE);
+    }
+    if (listen(fd, 5) < 0)
+    {
+        syslog(LOG_ERR, "listen() failed");
+        exit(EXIT_FAILURE);
+    }
+    syslog(LOG_INFO, "Server listening on %s", path);
+    return fd;
+}
+
+// path made absolute against the current directory, so it still names the same file after
+// daemon() changed directory to /. Returns a malloc'ed string
+static char *absolute_path(const char *path)
+{
+    char *absolute = NULL;
+    if (path[0] == '/')
+    {
+        absolute = strdup(path);
+    }
+    else
+    {
+        char *cwd = getcwd(NULL, 0);
+        if (cwd != NULL)
+        {
+            size_t size = strlen(cwd) + 1 + strlen(path) + 1;
+            absolute = malloc(size);
+            if (absolute != NULL)
+            {
+                snprintf(absolute, size, "%s/%s", cwd, path);
+            }
+        }
+        free(cwd);
+    }
+    if (absolute == NULL)
+    {
+        syslog(LOG_ERR, "can't resolve path %s", path);
+        exit(EXIT_FAILURE);
+    }
+    return absolute;
+}
+
 int main(int argc, char *argv[])
 {
     // Create a tcp socket server and bind to port 9000
@@ -338,24 +975,71 @@ int main(int argc, char *argv[])
 
     syslog(LOG_INFO, "Server listening on port %d", PORT);
 
+    // absolute, since they are unlinked on exit after daemon() changed directory
+    char *unix_stream_path = NULL;
+    char *unix_seqpacket_path = NULL;
+    struct admission_limits limits = {0, 0, 0};
+
     // parse command line arguments
-    while ((opt = getopt(argc, argv, "d")) != -1)
+    int profile = 0;
+    int daemonize = 0;
+    while ((opt = getopt(argc, argv, "du:q:c:a:r:p")) != -1)
     {
         switch (opt)
         {
         case 'd':
-            // daemonize the process
-            if (daemon(0, 0) < 0)
-            {
-                perror("daemon() failed");
-                exit(EXIT_FAILURE);
-            }
+            daemonize = 1;
+            break;
+        case 'u':
+            free(unix_stream_path);
+            unix_stream_path = absolute_path(optarg);
+            break;
+        case 'q':
+            free(unix_seqpacket_path);
+            unix_seqpacket_path = absolute_path(optarg);
+            break;
+        case 'c':
+            limits.connections_per_sec = strtod(optarg, NULL);
+            break;
+        case 'a':
+            limits.append_bytes_per_sec = strtod(optarg, NULL);
+            break;
+        case 'r':
+            limits.reply_bytes_per_sec = strtod(optarg, NULL);
+            break;
+        case 'p':
+            profile = 1;
             break;
         default:
-            printf("Usage: %s [-d]", argv[0]);
+            printf("Usage: %s [-d] [-u unix_stream_path] [-q unix_seqpacket_path] "
+                   "[-c connections_per_sec] [-a append_bytes_per_sec] [-r reply_bytes_per_sec] [-p]",
+                   argv[0]);
         }
     }
 
+    // daemonize the process once every option is parsed, so unix socket paths given after -d are
+    // resolved against the directory we were started in rather than /
+    if (daemonize && daemon(0, 0) < 0)
+    {
+        perror("daemon() failed");
+        exit(EXIT_FAILURE);
+    }
+
+    admission_init(&limits);
+    profile_init(profile);
+
+    // optional listeners for clients on the same host, they skip the TCP/IP stack
+    int unix_stream_sk = -1;
+    int unix_seqpacket_sk = -1;
+    if (unix_stream_path != NULL)
+    {
+        unix_stream_sk = listen_unix(unix_stream_path, SOCK_STREAM);
+    }
+    if (unix_seqpacket_path != NULL)
+    {
+        unix_seqpacket_sk = listen_unix(unix_seqpacket_path, SOCK_SEQPACKET);
+    }
+
     ret = listen(sk, 5);
     if (ret < 0)
     {
@@ -370,6 +1054,9 @@ int main(int argc, char *argv[])
     sigemptyset(&sa.sa_mask);
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    // replies to clients shut down on exit or gone early fail with EPIPE instead of killing us
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 
 
     // create a mutex for looking fd
@@ -395,69 +1082,127 @@ int main(int argc, char *argv[])
     head;
     TAILQ_INIT(&head);
 
-    while (exit_flag == 0)
+    struct pollfd listeners[3];
+    int listener_transport[3];
+    nfds_t listener_count = 0;
+    listeners[listener_count].fd = sk;
+    listener_transport[listener_count++] = TRANSPORT_TCP;
+    if (unix_stream_sk >= 0)
+    {
+        listeners[listener_count].fd = unix_stream_sk;
+        listener_transport[listener_count++] = TRANSPORT_UNIX_STREAM;
+    }
+    if (unix_seqpacket_sk >= 0)
     {
+        listeners[listener_count].fd = unix_seqpacket_sk;
+        listener_transport[listener_count++] = TRANSPORT_UNIX_SEQPACKET;
+    }
+    for (nfds_t i = 0; i < listener_count; i++)
+    {
+        listeners[i].events = POLLIN;
+    }
 
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
-        int client_sk = accept(sk, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_sk < 0)
+    while (exit_flag == 0)
+    {
+        ret = poll(listeners, listener_count, -1);
+        if (ret < 0)
         {
             if (errno == EINTR)
             {
-                syslog(LOG_INFO, "Caught signal, exiting");
-                break;
+                continue;
             }
-            syslog(LOG_ERR, "accept() failed %s", strerror(errno));
+            syslog(LOG_ERR, "poll() failed %s", strerror(errno));
             exit(EXIT_FAILURE);
         }
 
-        // syslog accepted connection from client
-        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(client_addr.sin_addr));
+        for (nfds_t i = 0; i < listener_count && exit_flag == 0; i++)
+        {
+            if (listeners[i].revents == 0)
+            {
+                continue;
+            }
 
-        struct node *node = malloc(sizeof(struct node));
+            struct sockaddr_in client_addr;
+            socklen_t client_addr_len = sizeof(client_addr);
+            memset(&client_addr, 0, sizeof(client_addr));
+            int client_sk = accept(listeners[i].fd,
+                                   listener_transport[i] == TRANSPORT_TCP ? (struct sockaddr *)&client_addr : NULL,
+                                   listener_transport[i] == TRANSPORT_TCP ? &client_addr_len : NULL);
+            if (client_sk < 0)
+            {
+                if (errno == EINTR || exit_flag == 1)
+                {
+                    break;
+                }
+                syslog(LOG_ERR, "accept() failed %s", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
 
-        node->client_sk = client_sk;
-        node->fd = -1;
-        node->mutex = &mutex;
-        node->finished = 0;
-        node->client_addr = client_addr;
+            // turn away clients over their budget before spending a thread on them
+            if (listener_transport[i] == TRANSPORT_TCP && !admission_accept(client_addr.sin_addr))
+            {
+                __atomic_fetch_add(&server_stats.rejected, 1, __ATOMIC_RELAXED);
+                syslog(LOG_DEBUG, "Rejected connection from %s", inet_ntoa(client_addr.sin_addr));
+                close(client_sk);
+                continue;
+            }
 
-        TAILQ_INSERT_TAIL(&head, node, nodes);
+            __atomic_fetch_add(&server_stats.connections, 1, __ATOMIC_RELAXED);
 
-        // create a thread
-        pthread_t thread;
-        ret = pthread_create(&thread, NULL, thread_start, node);
-        if (ret < 0)
-        {
-            syslog(LOG_ERR, "pthread_create() failed");
-            exit(EXIT_FAILURE);
-        }
+            struct node *node = malloc(sizeof(struct node));
 
-        node->tid = thread;
+            node->client_sk = client_sk;
+            node->fd = -1;
+            node->mutex = &mutex;
+            node->finished = 0;
+            node->client_addr = client_addr;
+            node->transport = listener_transport[i];
+
+            // syslog accepted connection from client
+            syslog(LOG_INFO, "Accepted connection from %s", client_name(node));
+
+            TAILQ_INSERT_TAIL(&head, node, nodes);
+
+            // create a thread
+            pthread_t thread;
+            ret = pthread_create(&thread, NULL, thread_start, node);
+            if (ret < 0)
+            {
+                syslog(LOG_ERR, "pthread_create() failed");
+                exit(EXIT_FAILURE);
+            }
+
+            node->tid = thread;
+        }
 
         // loop through the linked list and check if any thread has finished
+        struct node *node;
         JOIN_FINISHED_THREADS(node, head, nodes)
     }
+    syslog(LOG_INFO, "Caught signal, exiting");
+
+    // binary clients keep their connection open between requests, wake threads blocked reading
+    // from idle clients so they see the connection end
+    struct node *node;
+    TAILQ_FOREACH(node, &head, nodes)
+    {
+        if (__atomic_load_n(&node->finished, __ATOMIC_ACQUIRE) == 0)
+        {
+            shutdown(node->client_sk, SHUT_RDWR);
+        }
+    }
 
     // wait for all threads to finish
-    while (!TAILQ_EMPTY(&head))
+    while ((node = TAILQ_FIRST(&head)) != NULL)
     {
-        struct node *node;
-        TAILQ_FOREACH(node, &head, nodes)
+        ret = pthread_join(node->tid, NULL);
+        if (ret != 0)
         {
-            if (node->finished == 1)
-            {
-                ret = pthread_join(node->tid, NULL);
-                if (ret < 0)
-                {
-                    syslog(LOG_ERR, "pthread_join() failed");
-                    exit(EXIT_FAILURE);
-                }
-                TAILQ_REMOVE(&head, node, nodes);
-                free(node);
-            }
+            syslog(LOG_ERR, "pthread_join() failed");
+            exit(EXIT_FAILURE);
         }
+        TAILQ_REMOVE(&head, node, nodes);
+        free(node);
     }
 
     // cancel timestamp thread
@@ -477,6 +1222,20 @@ int main(int argc, char *argv[])
     }
 
     close(sk);
+    admission_cleanup();
+    profile_report();
+    if (unix_stream_sk >= 0)
+    {
+        close(unix_stream_sk);
+        unlink(unix_stream_path);
+    }
+    if (unix_seqpacket_sk >= 0)
+    {
+        close(unix_seqpacket_sk);
+        unlink(unix_seqpacket_path);
+    }
+    free(unix_stream_path);
+    free(unix_seqpacket_path);
     // delete the file
 #if USE_AESD_CHAR_DEVICE != 1
     unlink(AESD_FILE);
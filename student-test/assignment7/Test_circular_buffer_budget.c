@@ -0,0 +1,132 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static const char *strings[] = { "one\n", "two\n", "three\n", "four\n", "five\n", "six\n" };
+
+/**
+ * Evicts until an entry of size bytes fits, then adds string as that entry, the way the driver
+ * stores a write
+ * @return the number of entries evicted
+ */
+static int add_within_budget(struct aesd_circular_buffer *buffer, const char *string, size_t size)
+{
+    struct aesd_buffer_entry entry;
+    const char *evicted;
+    int evictions = 0;
+    while (aesd_circular_buffer_evict_for(buffer, size, &evicted))
+    {
+        TEST_ASSERT_NOT_NULL_MESSAGE(evicted, "Eviction should hand back the buffptr to free");
+        evictions++;
+    }
+    entry.buffptr = string;
+    entry.size = size;
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_add_entry(buffer, &entry),
+                             "evict_for() should already have made room for the entry");
+    return evictions;
+}
+
+/**
+ * Without a byte budget evict_for() only evicts once the buffer holds capacity entries
+ */
+void test_circular_buffer_evict_for_no_budget()
+{
+    struct aesd_circular_buffer buffer;
+    const char *evicted = NULL;
+    uint32_t i;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_FALSE_MESSAGE(aesd_circular_buffer_evict_for(&buffer, 1000, &evicted),
+                              "An empty buffer has nothing to evict");
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+    {
+        TEST_ASSERT_EQUAL_INT(0, add_within_budget(&buffer, strings[i % 6], 1000));
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_TRUE(aesd_circular_buffer_evict_for(&buffer, 1, &evicted));
+    TEST_ASSERT_EQUAL_PTR(strings[0], evicted);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_evict_for(&buffer, 1, &evicted));
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1, aesd_circular_buffer_count(&buffer));
+}
+
+/**
+ * With a byte budget the oldest entries are evicted until the new one fits, so total_size never
+ * exceeds the budget, and an entry exactly filling the remaining room evicts nothing
+ */
+void test_circular_buffer_evict_for_byte_budget()
+{
+    struct aesd_circular_buffer buffer;
+    const char *evicted = NULL;
+    size_t entry_offset;
+
+    aesd_circular_buffer_init(&buffer);
+    buffer.byte_budget = 10;
+    TEST_ASSERT_EQUAL_INT(0, add_within_budget(&buffer, strings[0], 4));
+    TEST_ASSERT_EQUAL_INT(0, add_within_budget(&buffer, strings[1], 4));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, add_within_budget(&buffer, strings[5], 2),
+                                  "An entry exactly filling the budget should fit");
+    TEST_ASSERT_EQUAL(10, buffer.total_size);
+
+    // 6 bytes need the first two entries gone
+    TEST_ASSERT_TRUE(aesd_circular_buffer_evict_for(&buffer, 6, &evicted));
+    TEST_ASSERT_EQUAL_PTR(strings[0], evicted);
+    TEST_ASSERT_TRUE(aesd_circular_buffer_evict_for(&buffer, 6, &evicted));
+    TEST_ASSERT_EQUAL_PTR(strings[1], evicted);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_evict_for(&buffer, 6, &evicted));
+    TEST_ASSERT_EQUAL(2, buffer.total_size);
+    TEST_ASSERT_EQUAL_UINT32(1, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_INT(0, add_within_budget(&buffer, strings[2], 6));
+    TEST_ASSERT_EQUAL(8, buffer.total_size);
+    TEST_ASSERT_FALSE(buffer.full);
+
+    // the remaining entries stay readable from fpos 0 on
+    TEST_ASSERT_EQUAL_PTR(strings[5], aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &entry_offset)->buffptr);
+    TEST_ASSERT_EQUAL_PTR(strings[2], aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 2, &entry_offset)->buffptr);
+    TEST_ASSERT_EQUAL(0, entry_offset);
+}
+
+/**
+ * An entry larger than the whole budget evicts everything and is then stored on its own
+ */
+void test_circular_buffer_evict_for_oversized_entry()
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    buffer.byte_budget = 10;
+    add_within_budget(&buffer, strings[0], 4);
+    add_within_budget(&buffer, strings[1], 4);
+    TEST_ASSERT_EQUAL_INT(2, add_within_budget(&buffer, strings[2], 16));
+    TEST_ASSERT_EQUAL_UINT32(1, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL(16, buffer.total_size);
+
+    // the next entry then evicts the oversized one, however small
+    TEST_ASSERT_EQUAL_INT(1, add_within_budget(&buffer, strings[3], 1));
+    TEST_ASSERT_EQUAL(1, buffer.total_size);
+}
+
+/**
+ * The capacity still applies under a budget large enough never to be reached
+ */
+void test_circular_buffer_evict_for_budget_and_capacity()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[4];
+    uint32_t i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, entries, 4, 3));
+    buffer.byte_budget = 1000;
+    for (i = 0; i < 3; i++)
+    {
+        TEST_ASSERT_EQUAL_INT(0, add_within_budget(&buffer, strings[i], strlen(strings[i])));
+    }
+    for (i = 3; i < 6; i++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(1, add_within_budget(&buffer, strings[i], strlen(strings[i])),
+                                      "A full buffer should evict exactly one entry per add");
+    }
+    TEST_ASSERT_EQUAL_UINT32(3, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL(strlen(strings[3]) + strlen(strings[4]) + strlen(strings[5]), buffer.total_size);
+}
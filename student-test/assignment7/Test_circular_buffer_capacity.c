@@ -0,0 +1,134 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static const char *strings[] = { "a\n", "bb\n", "ccc\n", "dddd\n", "eeeee\n", "ffffff\n", "ggggggg\n" };
+
+static void add_string(struct aesd_circular_buffer *buffer, const char *string)
+{
+    struct aesd_buffer_entry entry;
+    entry.buffptr = string;
+    entry.size = strlen(string);
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+ * aesd_circular_buffer_slots_for() rounds capacities up to a power of two, and
+ * aesd_circular_buffer_init_capacity() rejects slot counts which aren't one or can't hold the capacity
+ */
+void test_circular_buffer_init_capacity()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[8];
+
+    TEST_ASSERT_EQUAL_UINT32(1, aesd_circular_buffer_slots_for(1));
+    TEST_ASSERT_EQUAL_UINT32(4, aesd_circular_buffer_slots_for(3));
+    TEST_ASSERT_EQUAL_UINT32(8, aesd_circular_buffer_slots_for(8));
+    TEST_ASSERT_EQUAL_UINT32(16, aesd_circular_buffer_slots_for(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED));
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_CAPACITY, aesd_circular_buffer_slots_for(AESDCHAR_MAX_CAPACITY));
+    TEST_ASSERT_EQUAL_UINT32(0, aesd_circular_buffer_slots_for(AESDCHAR_MAX_CAPACITY + 1));
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_circular_buffer_init_capacity(&buffer, entries, 8, 0),
+                                  "A capacity of 0 should be rejected");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_circular_buffer_init_capacity(&buffer, entries, 6, 5),
+                                  "Slot counts which aren't a power of two should be rejected");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_circular_buffer_init_capacity(&buffer, entries, 4, 5),
+                                  "Fewer slots than the capacity should be rejected");
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, entries, 8, 5));
+    TEST_ASSERT_EQUAL_PTR(entries, buffer.entry);
+    TEST_ASSERT_EQUAL_UINT32(5, buffer.capacity);
+    TEST_ASSERT_EQUAL_UINT32(7, buffer.mask);
+    TEST_ASSERT_EQUAL_UINT32(0, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_FALSE(buffer.full);
+    TEST_ASSERT_EQUAL(0, buffer.total_size);
+}
+
+/**
+ * A buffer of capacity 5 over 8 slots keeps the last 5 entries. Enough adds to wrap the slots
+ * several times must evict in order, keep fpos lookups right across the wrap, and never touch
+ * the slots the buffer doesn't own.
+ */
+void test_circular_buffer_capacity_wraparound()
+{
+    struct aesd_circular_buffer buffer;
+    // one guard slot on either side of the 8 the buffer owns
+    struct aesd_buffer_entry storage[10];
+    struct aesd_buffer_entry *entries = &storage[1];
+    const uint32_t adds = 3 * 8 + 3;
+    size_t expected_total = 0;
+    size_t offset = 0;
+    size_t entry_offset;
+    uint32_t i;
+
+    memset(storage, 0x5a, sizeof(storage));
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, entries, 8, 5));
+    for (i = 0; i < adds; i++)
+    {
+        const char *string = strings[i % 7];
+        const char *evicted_expected = i >= 5 ? strings[(i - 5) % 7] : NULL;
+        struct aesd_buffer_entry entry;
+        entry.buffptr = string;
+        entry.size = strlen(string);
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(evicted_expected, aesd_circular_buffer_add_entry(&buffer, &entry),
+                                      "The oldest entry should be evicted once capacity entries are stored");
+        TEST_ASSERT_EQUAL_UINT32(i < 5 ? i + 1 : 5, aesd_circular_buffer_count(&buffer));
+        TEST_ASSERT_EQUAL(i >= 4, buffer.full);
+    }
+    TEST_ASSERT_EQUAL_UINT32(adds, buffer.in_offs);
+    TEST_ASSERT_EQUAL_UINT32(adds - 5, buffer.out_offs);
+
+    for (i = adds - 5; i < adds; i++)
+    {
+        expected_total += strlen(strings[i % 7]);
+    }
+    TEST_ASSERT_EQUAL(expected_total, buffer.total_size);
+
+    // every byte of the 5 remaining entries, in order, then one past the end
+    for (i = adds - 5; i < adds; i++)
+    {
+        const char *string = strings[i % 7];
+        size_t byte;
+        for (byte = 0; byte < strlen(string); byte++, offset++)
+        {
+            struct aesd_buffer_entry *entry =
+                aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset, &entry_offset);
+            TEST_ASSERT_NOT_NULL(entry);
+            TEST_ASSERT_EQUAL_PTR(string, entry->buffptr);
+            TEST_ASSERT_EQUAL(byte, entry_offset);
+        }
+    }
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset, &entry_offset));
+
+    TEST_ASSERT_EACH_EQUAL_HEX8_MESSAGE(0x5a, &storage[0], sizeof(storage[0]),
+                                        "The slot before the entries array should be untouched");
+    TEST_ASSERT_EACH_EQUAL_HEX8_MESSAGE(0x5a, &storage[9], sizeof(storage[9]),
+                                        "The slot after the entries array should be untouched");
+}
+
+/**
+ * With a single slot every add evicts the previous entry
+ */
+void test_circular_buffer_capacity_one()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    size_t entry_offset;
+    uint32_t i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, &entry, 1, 1));
+    add_string(&buffer, strings[0]);
+    TEST_ASSERT_TRUE(buffer.full);
+    for (i = 1; i < 7; i++)
+    {
+        struct aesd_buffer_entry add;
+        add.buffptr = strings[i];
+        add.size = strlen(strings[i]);
+        TEST_ASSERT_EQUAL_PTR(strings[i - 1], aesd_circular_buffer_add_entry(&buffer, &add));
+        TEST_ASSERT_EQUAL(strlen(strings[i]), buffer.total_size);
+        TEST_ASSERT_EQUAL_PTR(strings[i], aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, i, &entry_offset)->buffptr);
+        TEST_ASSERT_EQUAL(i, entry_offset);
+    }
+}
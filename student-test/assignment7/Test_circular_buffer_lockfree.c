@@ -0,0 +1,276 @@
+#include "unity.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer-lockfree.h"
+
+#define RING_SLOTS 8
+#define THREADED_ENTRIES 100000
+
+static struct aesd_buffer_entry entry_for(uint32_t index)
+{
+    struct aesd_buffer_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.size = index;
+    entry.stream_offs = index;
+    return entry;
+}
+
+/**
+ * Moves the free running indices of an empty spsc ring to @param index, as if that many entries
+ * had been pushed and popped already
+ */
+static void spsc_ring_start_at(struct aesd_spsc_ring *ring, uint32_t index)
+{
+    atomic_store(&ring->in_offs, index);
+    atomic_store(&ring->out_offs, index);
+    ring->out_cached = index;
+    ring->in_cached = index;
+}
+
+/**
+ * Moves the free running indices of an empty mpsc ring to @param index, each slot ready for the
+ * first index at or after it which maps to the slot
+ */
+static void mpsc_ring_start_at(struct aesd_mpsc_ring *ring, uint32_t index)
+{
+    uint32_t i;
+    for (i = 0; i <= ring->mask; i++)
+    {
+        atomic_store(&ring->slot[(index + i) & ring->mask].sequence, index + i);
+    }
+    atomic_store(&ring->in_offs, index);
+    ring->out_offs = index;
+}
+
+void test_circular_buffer_lockfree_init_rejects_bad_sizes()
+{
+    struct aesd_buffer_entry entries[RING_SLOTS];
+    struct aesd_mpsc_slot slots[RING_SLOTS];
+    struct aesd_spsc_ring spsc;
+    struct aesd_mpsc_ring mpsc;
+
+    TEST_ASSERT_EQUAL_INT(-1, aesd_spsc_ring_init(&spsc, entries, 0));
+    TEST_ASSERT_EQUAL_INT(-1, aesd_spsc_ring_init(&spsc, entries, 6));
+    TEST_ASSERT_EQUAL_INT(0, aesd_spsc_ring_init(&spsc, entries, RING_SLOTS));
+    TEST_ASSERT_EQUAL_INT(-1, aesd_mpsc_ring_init(&mpsc, slots, 0));
+    TEST_ASSERT_EQUAL_INT(-1, aesd_mpsc_ring_init(&mpsc, slots, 6));
+    TEST_ASSERT_EQUAL_INT(0, aesd_mpsc_ring_init(&mpsc, slots, RING_SLOTS));
+}
+
+/**
+ * An empty ring pops nothing, a full one refuses the next push instead of overwriting the oldest
+ * entry, and popping one entry makes room for exactly one more
+ */
+void test_circular_buffer_lockfree_spsc_full_and_empty()
+{
+    struct aesd_buffer_entry entries[RING_SLOTS];
+    struct aesd_spsc_ring ring;
+    struct aesd_buffer_entry entry;
+    uint32_t i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_spsc_ring_init(&ring, entries, RING_SLOTS));
+    TEST_ASSERT_FALSE_MESSAGE(aesd_spsc_ring_pop(&ring, &entry), "An empty ring should pop nothing");
+    for (i = 0; i < RING_SLOTS; i++)
+    {
+        entry = entry_for(i);
+        TEST_ASSERT_TRUE(aesd_spsc_ring_push(&ring, &entry));
+    }
+    entry = entry_for(RING_SLOTS);
+    TEST_ASSERT_FALSE_MESSAGE(aesd_spsc_ring_push(&ring, &entry), "A full ring should refuse a push");
+
+    TEST_ASSERT_TRUE(aesd_spsc_ring_pop(&ring, &entry));
+    TEST_ASSERT_EQUAL_UINT32(0, entry.size);
+    entry = entry_for(RING_SLOTS);
+    TEST_ASSERT_TRUE(aesd_spsc_ring_push(&ring, &entry));
+    TEST_ASSERT_FALSE(aesd_spsc_ring_push(&ring, &entry));
+
+    for (i = 1; i <= RING_SLOTS; i++)
+    {
+        TEST_ASSERT_TRUE(aesd_spsc_ring_pop(&ring, &entry));
+        TEST_ASSERT_EQUAL_UINT32(i, entry.size);
+    }
+    TEST_ASSERT_FALSE(aesd_spsc_ring_pop(&ring, &entry));
+}
+
+void test_circular_buffer_lockfree_mpsc_full_and_empty()
+{
+    struct aesd_mpsc_slot slots[RING_SLOTS];
+    struct aesd_mpsc_ring ring;
+    struct aesd_buffer_entry entry;
+    uint32_t i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_mpsc_ring_init(&ring, slots, RING_SLOTS));
+    TEST_ASSERT_FALSE_MESSAGE(aesd_mpsc_ring_pop(&ring, &entry), "An empty ring should pop nothing");
+    for (i = 0; i < RING_SLOTS; i++)
+    {
+        entry = entry_for(i);
+        TEST_ASSERT_TRUE(aesd_mpsc_ring_push(&ring, &entry));
+    }
+    entry = entry_for(RING_SLOTS);
+    TEST_ASSERT_FALSE_MESSAGE(aesd_mpsc_ring_push(&ring, &entry), "A full ring should refuse a push");
+
+    TEST_ASSERT_TRUE(aesd_mpsc_ring_pop(&ring, &entry));
+    TEST_ASSERT_EQUAL_UINT32(0, entry.size);
+    entry = entry_for(RING_SLOTS);
+    TEST_ASSERT_TRUE(aesd_mpsc_ring_push(&ring, &entry));
+    TEST_ASSERT_FALSE(aesd_mpsc_ring_push(&ring, &entry));
+
+    for (i = 1; i <= RING_SLOTS; i++)
+    {
+        TEST_ASSERT_TRUE(aesd_mpsc_ring_pop(&ring, &entry));
+        TEST_ASSERT_EQUAL_UINT32(i, entry.size);
+    }
+    TEST_ASSERT_FALSE(aesd_mpsc_ring_pop(&ring, &entry));
+}
+
+/**
+ * Full and empty are told apart by the difference of the free running indices, which has to keep
+ * working when in_offs wraps past UINT32_MAX before out_offs does
+ */
+void test_circular_buffer_lockfree_spsc_index_wraparound()
+{
+    struct aesd_buffer_entry entries[RING_SLOTS];
+    struct aesd_spsc_ring ring;
+    struct aesd_buffer_entry entry;
+    uint32_t i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_spsc_ring_init(&ring, entries, RING_SLOTS));
+    spsc_ring_start_at(&ring, UINT32_MAX - 2);
+    for (i = 0; i < RING_SLOTS; i++)
+    {
+        entry = entry_for(i);
+        TEST_ASSERT_TRUE(aesd_spsc_ring_push(&ring, &entry));
+    }
+    TEST_ASSERT_EQUAL_UINT32(RING_SLOTS - 3, atomic_load(&ring.in_offs));
+    TEST_ASSERT_FALSE_MESSAGE(aesd_spsc_ring_push(&ring, &entry), "A full ring should refuse a push across the wrap");
+    for (i = 0; i < RING_SLOTS; i++)
+    {
+        TEST_ASSERT_TRUE(aesd_spsc_ring_pop(&ring, &entry));
+        TEST_ASSERT_EQUAL_UINT32(i, entry.size);
+    }
+    TEST_ASSERT_FALSE_MESSAGE(aesd_spsc_ring_pop(&ring, &entry), "An empty ring should pop nothing across the wrap");
+}
+
+void test_circular_buffer_lockfree_mpsc_index_wraparound()
+{
+    struct aesd_mpsc_slot slots[RING_SLOTS];
+    struct aesd_mpsc_ring ring;
+    struct aesd_buffer_entry entry;
+    uint32_t round;
+    uint32_t i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_mpsc_ring_init(&ring, slots, RING_SLOTS));
+    mpsc_ring_start_at(&ring, UINT32_MAX - 2);
+    // a few rounds, so slot sequences wrap as well as the indices
+    for (round = 0; round < 3; round++)
+    {
+        for (i = 0; i < RING_SLOTS; i++)
+        {
+            entry = entry_for(round * RING_SLOTS + i);
+            TEST_ASSERT_TRUE(aesd_mpsc_ring_push(&ring, &entry));
+        }
+        TEST_ASSERT_FALSE_MESSAGE(aesd_mpsc_ring_push(&ring, &entry), "A full ring should refuse a push across the wrap");
+        for (i = 0; i < RING_SLOTS; i++)
+        {
+            TEST_ASSERT_TRUE(aesd_mpsc_ring_pop(&ring, &entry));
+            TEST_ASSERT_EQUAL_UINT32(round * RING_SLOTS + i, entry.size);
+        }
+        TEST_ASSERT_FALSE_MESSAGE(aesd_mpsc_ring_pop(&ring, &entry), "An empty ring should pop nothing across the wrap");
+    }
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX - 2 + 3 * RING_SLOTS, ring.out_offs);
+}
+
+/**
+ * Pushes THREADED_ENTRIES entries numbered in order, yielding to the consumer while the ring is full
+ */
+static void *mpsc_producer(void *arg)
+{
+    struct aesd_mpsc_ring *ring = arg;
+    uint32_t i;
+    for (i = 0; i < THREADED_ENTRIES; i++)
+    {
+        struct aesd_buffer_entry entry = entry_for(i);
+        while (!aesd_mpsc_ring_push(ring, &entry))
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *spsc_producer(void *arg)
+{
+    struct aesd_spsc_ring *ring = arg;
+    uint32_t i;
+    for (i = 0; i < THREADED_ENTRIES; i++)
+    {
+        struct aesd_buffer_entry entry = entry_for(i);
+        while (!aesd_spsc_ring_push(ring, &entry))
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * With a single producer thread the consumer sees every entry exactly once, in push order, while
+ * the ring keeps running full and empty and its indices wrap
+ */
+void test_circular_buffer_lockfree_mpsc_single_producer_order()
+{
+    struct aesd_mpsc_slot slots[RING_SLOTS];
+    struct aesd_mpsc_ring ring;
+    struct aesd_buffer_entry entry;
+    pthread_t producer;
+    uint32_t expected = 0;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_mpsc_ring_init(&ring, slots, RING_SLOTS));
+    mpsc_ring_start_at(&ring, UINT32_MAX - THREADED_ENTRIES / 2);
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&producer, NULL, mpsc_producer, &ring));
+    while (expected < THREADED_ENTRIES)
+    {
+        if (aesd_mpsc_ring_pop(&ring, &entry))
+        {
+            TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected, entry.size, "Entries should be popped in push order");
+            TEST_ASSERT_EQUAL_UINT32(expected, entry.stream_offs);
+            expected++;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(producer, NULL));
+    TEST_ASSERT_FALSE(aesd_mpsc_ring_pop(&ring, &entry));
+}
+
+void test_circular_buffer_lockfree_spsc_order()
+{
+    struct aesd_buffer_entry entries[RING_SLOTS];
+    struct aesd_spsc_ring ring;
+    struct aesd_buffer_entry entry;
+    pthread_t producer;
+    uint32_t expected = 0;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_spsc_ring_init(&ring, entries, RING_SLOTS));
+    spsc_ring_start_at(&ring, UINT32_MAX - THREADED_ENTRIES / 2);
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&producer, NULL, spsc_producer, &ring));
+    while (expected < THREADED_ENTRIES)
+    {
+        if (aesd_spsc_ring_pop(&ring, &entry))
+        {
+            TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected, entry.size, "Entries should be popped in push order");
+            expected++;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(producer, NULL));
+    TEST_ASSERT_FALSE(aesd_spsc_ring_pop(&ring, &entry));
+}
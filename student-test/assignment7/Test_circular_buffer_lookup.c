@@ -0,0 +1,160 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static const char *strings[] = { "a\n", "b\n", "c\n", "d\n", "e\n", "f\n", "g\n", "h\n", "i\n", "j\n", "k\n", "l\n",
+                                 "m\n", "n\n" };
+
+/**
+ * Adds the first count strings to a default buffer, then overwrites the timestamps of the entries
+ * still stored with 100 times their sequence, so lookups don't depend on the clock
+ */
+static void fill_buffer(struct aesd_circular_buffer *buffer, uint32_t count)
+{
+    uint32_t i;
+    aesd_circular_buffer_init(buffer);
+    for (i = 0; i < count; i++)
+    {
+        struct aesd_buffer_entry entry;
+        entry.buffptr = strings[i];
+        entry.size = strlen(strings[i]);
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    for (i = buffer->out_offs; i != buffer->in_offs; i++)
+    {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_slot(buffer, i);
+        entry->timestamp_ns = 100 * entry->sequence;
+    }
+}
+
+/**
+ * add_entry() numbers entries consecutively and stamps them with a clock which never goes back
+ */
+void test_circular_buffer_add_entry_sequence_and_time()
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t i;
+
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < 13; i++)
+    {
+        struct aesd_buffer_entry entry;
+        entry.buffptr = strings[i];
+        entry.size = strlen(strings[i]);
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    TEST_ASSERT_EQUAL_UINT64(13, buffer.sequence);
+    for (i = buffer.out_offs; i != buffer.in_offs; i++)
+    {
+        TEST_ASSERT_EQUAL_UINT64(i, aesd_circular_buffer_slot(&buffer, i)->sequence);
+        if (i != buffer.out_offs)
+        {
+            TEST_ASSERT_TRUE_MESSAGE(aesd_circular_buffer_slot(&buffer, i - 1)->timestamp_ns <=
+                                         aesd_circular_buffer_slot(&buffer, i)->timestamp_ns,
+                                     "Entry timestamps should never decrease");
+        }
+    }
+}
+
+/**
+ * find_index_for_time() finds the oldest entry added at or after the time
+ */
+void test_circular_buffer_find_index_for_time()
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t index = 0;
+
+    // 13 adds into 10 entries, sequences 3 to 12 remain at times 300 to 1200
+    fill_buffer(&buffer, 13);
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_find_index_for_time(&buffer, 0, &index));
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(buffer.out_offs, index, "A time before every entry should find the oldest");
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_find_index_for_time(&buffer, 700, &index));
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(strings[7], aesd_circular_buffer_slot(&buffer, index)->buffptr,
+                                  "An exact time should find the entry added then");
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_find_index_for_time(&buffer, 701, &index));
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(strings[8], aesd_circular_buffer_slot(&buffer, index)->buffptr,
+                                  "A time between entries should find the next one");
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_find_index_for_time(&buffer, 1200, &index));
+    TEST_ASSERT_EQUAL_UINT32(buffer.in_offs - 1, index);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_circular_buffer_find_index_for_time(&buffer, 1201, &index),
+                                  "A time after every entry should find none");
+}
+
+/**
+ * Entries added in the same clock tick share a timestamp, the oldest of them is found
+ */
+void test_circular_buffer_find_index_for_time_equal_timestamps()
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t index = 0;
+    uint32_t i;
+
+    fill_buffer(&buffer, 6);
+    for (i = 2; i < 5; i++)
+    {
+        aesd_circular_buffer_slot(&buffer, i)->timestamp_ns = 250;
+    }
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_find_index_for_time(&buffer, 250, &index));
+    TEST_ASSERT_EQUAL_UINT32(2, index);
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_find_index_for_time(&buffer, 251, &index));
+    TEST_ASSERT_EQUAL_UINT32(5, index);
+}
+
+void test_circular_buffer_find_index_for_time_empty()
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t index = 0;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_INT(-1, aesd_circular_buffer_find_index_for_time(&buffer, 0, &index));
+}
+
+/**
+ * find_index_for_sequence() finds the entry with the sequence, or the oldest one once it was
+ * evicted, and none for sequences not added yet
+ */
+void test_circular_buffer_find_index_for_sequence()
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t index = 0;
+    uint64_t sequence;
+
+    fill_buffer(&buffer, 13);
+    for (sequence = 3; sequence < 13; sequence++)
+    {
+        TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_find_index_for_sequence(&buffer, sequence, &index));
+        TEST_ASSERT_EQUAL_UINT64(sequence, aesd_circular_buffer_slot(&buffer, index)->sequence);
+        TEST_ASSERT_EQUAL_PTR(strings[sequence], aesd_circular_buffer_slot(&buffer, index)->buffptr);
+    }
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_find_index_for_sequence(&buffer, 0, &index));
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(buffer.out_offs, index, "An evicted sequence should find the oldest entry");
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_find_index_for_sequence(&buffer, 2, &index));
+    TEST_ASSERT_EQUAL_UINT32(buffer.out_offs, index);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_circular_buffer_find_index_for_sequence(&buffer, 13, &index),
+                                  "The next sequence isn't added yet");
+    TEST_ASSERT_EQUAL_INT(-1, aesd_circular_buffer_find_index_for_sequence(&buffer, UINT64_MAX, &index));
+}
+
+/**
+ * An emptied buffer keeps counting sequences, but has no entry to find
+ */
+void test_circular_buffer_find_index_for_sequence_empty()
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t index = 0;
+    const char *evicted;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_INT(-1, aesd_circular_buffer_find_index_for_sequence(&buffer, 0, &index));
+    fill_buffer(&buffer, 4);
+    buffer.byte_budget = 1;
+    while (aesd_circular_buffer_evict_for(&buffer, 1, &evicted))
+    {
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT64(4, buffer.sequence);
+    TEST_ASSERT_EQUAL_INT(-1, aesd_circular_buffer_find_index_for_sequence(&buffer, 0, &index));
+    TEST_ASSERT_EQUAL_INT(-1, aesd_circular_buffer_find_index_for_sequence(&buffer, 3, &index));
+}